@@ -33,10 +33,26 @@ static const uint32_t drvopts[] = { SR_CONF_LOGIC_ANALYZER, };
 static const uint32_t devopts[] = {
 		SR_CONF_CONTINUOUS,
 		SR_CONF_LIMIT_SAMPLES | SR_CONF_GET | SR_CONF_SET, SR_CONF_CONN | SR_CONF_GET,
+		SR_CONF_LIMIT_FRAMES | SR_CONF_GET | SR_CONF_SET,
 		SR_CONF_SAMPLERATE | SR_CONF_GET | SR_CONF_SET | SR_CONF_LIST,
 		SR_CONF_VOLTAGE_THRESHOLD | SR_CONF_GET | SR_CONF_SET | SR_CONF_LIST,
 		SR_CONF_TRIGGER_MATCH | SR_CONF_LIST,
-		SR_CONF_CAPTURE_RATIO | SR_CONF_GET | SR_CONF_SET, };
+		SR_CONF_CAPTURE_RATIO | SR_CONF_GET | SR_CONF_SET,
+		SR_CONF_BUFFERSIZE | SR_CONF_GET | SR_CONF_SET,
+		SR_CONF_TRANSFER_SIZE | SR_CONF_GET | SR_CONF_SET,
+		SR_CONF_NUM_TRANSFERS | SR_CONF_GET | SR_CONF_SET,
+		SR_CONF_AUTOTUNE | SR_CONF_GET | SR_CONF_SET,
+		SR_CONF_PIPELINE_DEPTH | SR_CONF_GET | SR_CONF_SET,
+		SR_CONF_OVERLOAD_POLICY | SR_CONF_GET | SR_CONF_SET | SR_CONF_LIST,
+		SR_CONF_MAX_LATENCY | SR_CONF_GET | SR_CONF_SET,
+		SR_CONF_PACKET_SIZE | SR_CONF_GET | SR_CONF_SET,
+		SR_CONF_PACKET_AGE | SR_CONF_GET | SR_CONF_SET,
+		SR_CONF_USB_THREAD | SR_CONF_GET | SR_CONF_SET,
+		SR_CONF_PIPELINE_OCCUPANCY | SR_CONF_GET,
+		SR_CONF_PIPELINE_HIGH_WATER | SR_CONF_GET,
+		SR_CONF_PIPELINE_OVERFLOWS | SR_CONF_GET,
+		SR_CONF_DROPPED_BYTES | SR_CONF_GET,
+		SR_CONF_FAILED_TRANSFERS | SR_CONF_GET, };
 
 static const int32_t trigger_matches[] = {
 		SR_TRIGGER_ZERO,
@@ -94,76 +110,245 @@ static const double thresholds[][2] = {
 
 struct libusb_device_handle * reconnect(struct drv_context *drvc, char * connection_id, struct dev_context *devc);
 
-struct libusb_device_handle * reconnect(struct drv_context *drvc, char * connection_id, struct dev_context *devc) {
+/*
+ * Opens the device at the port 'connection_id' when it is on the bus.
+ * Returns NULL when it is not there (yet) or can't be opened.
+ */
+static struct libusb_device_handle * open_renumerated(struct drv_context *drvc, const char * connection_id, struct dev_context *devc) {
 	struct libusb_device **devlist;
 	struct libusb_device_descriptor des;
 	char connection_id_buff[64];
 	struct libusb_device_handle *res = NULL;
 	int device_count, i, ret = 0;
-	int64_t timediff_us, timediff_ms;
 
-	/* Takes >= 300ms for the FX2 to be gone from the USB bus. */
-	g_usleep(300 * 1000);
-	timediff_ms = 0;
-	while (timediff_ms < MAX_RENUM_DELAY_MS) {
+	device_count = libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
+	if (device_count < 0) {
+		sr_err("Failed to get device list: %s.", libusb_error_name(device_count));
+		return NULL;
+	}
+
+	for (i = 0; i < device_count; i++) {
+		libusb_get_device_descriptor(devlist[i], &des);
+
+		if (des.idVendor != devc->profile.vid
+				|| des.idProduct != devc->profile.pid)
+			continue;
 
-		device_count = libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
-		if (device_count < 0) {
-			sr_err("Failed to get device list: %s.", libusb_error_name(device_count));
+		usb_get_port_path(devlist[i], connection_id_buff, sizeof(connection_id_buff));
+		if (strcmp(connection_id_buff, connection_id))
+			/* This is not the one. */
+			continue;
+
+		if ((ret = libusb_open(devlist[i], &res)) != 0) {
+			sr_err("Failed to open device: %s.", libusb_error_name(ret));
+			res = NULL;
 			break;
 		}
 
-		for (i = 0; i < device_count; i++) {
-			libusb_get_device_descriptor(devlist[i], &des);
+		if (libusb_has_capability(LIBUSB_CAP_SUPPORTS_DETACH_KERNEL_DRIVER)) {
+			if (libusb_kernel_driver_active(res, USB_INTERFACE) == 1) {
+				if ((ret = libusb_detach_kernel_driver(res, USB_INTERFACE)) < 0) {
+					sr_err("Failed to detach kernel driver: %s.",
+							libusb_error_name(ret));
+					libusb_close(res);
+					res = NULL;
+				}
+			}
+		}
 
-			if (des.idVendor != devc->profile.vid
-					|| des.idProduct != devc->profile.pid)
-				continue;
+		break;
+	}
 
-			usb_get_port_path(devlist[i], connection_id_buff, sizeof(connection_id_buff));
-			if (strcmp(connection_id_buff, connection_id))
-				/* This is not the one. */
-				continue;
+	libusb_free_device_list(devlist, 1);
 
-			if ((ret = libusb_open(devlist[i], &res)) != 0) {
-				sr_err("Failed to open device: %s.", libusb_error_name(ret));
-				ret = SR_ERR;
-				break;
-			}
+	return res;
+}
 
-			if (libusb_has_capability(LIBUSB_CAP_SUPPORTS_DETACH_KERNEL_DRIVER)) {
-				if (libusb_kernel_driver_active(res, USB_INTERFACE) == 1) {
-					if ((ret = libusb_detach_kernel_driver(res, USB_INTERFACE)) < 0) {
-						sr_err("Failed to detach kernel driver: %s.",
-								libusb_error_name(ret));
-						ret = SR_ERR;
-						break;
-					}
-				}
+/*
+ * Hotplug wait for the renumerated FX2: set when a device with the
+ * product IDs arrives at the port.
+ */
+struct renum_wait {
+	const char *connection_id;
+	int arrived;
+};
+
+static int LIBUSB_CALL renum_hotplug_cb(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data) {
+	struct renum_wait *wait;
+	char connection_id_buff[64];
+
+	(void) ctx;
+	(void) event;
+
+	wait = user_data;
+	usb_get_port_path(dev, connection_id_buff, sizeof(connection_id_buff));
+	if (!strcmp(connection_id_buff, wait->connection_id))
+		wait->arrived = TRUE;
+
+	return 0;
+}
+
+/*
+ * Waits for the device to come back after the FX2 firmware upload. With
+ * hotplug support libusb wakes us up when it arrives at the same port.
+ * Then the device is opened, retrying every 100 ms. Gives up
+ * MAX_RENUM_DELAY_MS after the upload.
+ */
+struct libusb_device_handle * reconnect(struct drv_context *drvc, char * connection_id, struct dev_context *devc) {
+	libusb_context *ctx;
+	libusb_hotplug_callback_handle callback;
+	struct renum_wait wait;
+	struct libusb_device_handle *res = NULL;
+	struct timeval tv;
+	int64_t timediff_ms;
+
+	ctx = drvc->sr_ctx->libusb_ctx;
+	wait.connection_id = connection_id;
+	wait.arrived = FALSE;
+
+	/* The old device is gone before the new one arrives. */
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)
+			&& libusb_hotplug_register_callback(ctx,
+					LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, 0,
+					devc->profile.vid, devc->profile.pid,
+					LIBUSB_HOTPLUG_MATCH_ANY, renum_hotplug_cb, &wait,
+					&callback) == LIBUSB_SUCCESS) {
+		timediff_ms = (g_get_monotonic_time() - devc->fw_updated) / 1000;
+		while (!wait.arrived && timediff_ms < MAX_RENUM_DELAY_MS) {
+			tv.tv_sec = 0;
+			tv.tv_usec = (MAX_RENUM_DELAY_MS - timediff_ms) * 1000;
+			if (tv.tv_usec >= 1000000) {
+				tv.tv_sec = tv.tv_usec / 1000000;
+				tv.tv_usec %= 1000000;
 			}
+			libusb_handle_events_timeout_completed(ctx, &tv, &wait.arrived);
+			timediff_ms = (g_get_monotonic_time() - devc->fw_updated) / 1000;
+		}
+		libusb_hotplug_deregister_callback(ctx, callback);
 
-			ret = SR_OK;
+		sr_dbg("Device %s after %" PRIi64 "ms.",
+				wait.arrived ? "arrived" : "didn't arrive", timediff_ms);
+	} else {
+		/* Takes >= 300ms for the FX2 to be gone from the USB bus. */
+		g_usleep(300 * 1000);
+	}
 
+	/*
+	 * An arrival missed by the callback is found by the listing, and the
+	 * arrived device may not be accessible until udev sets its permissions.
+	 */
+	for (;;) {
+		if ((res = open_renumerated(drvc, connection_id, devc)))
 			break;
-		}
 
-		libusb_free_device_list(devlist, 1);
+		timediff_ms = (g_get_monotonic_time() - devc->fw_updated) / 1000;
+		if (timediff_ms >= MAX_RENUM_DELAY_MS)
+			break;
+		sr_spew("Waited %" PRIi64 "ms.", timediff_ms);
 
 		g_usleep(100 * 1000);
+	}
 
-		timediff_us = g_get_monotonic_time() - devc->fw_updated;
-		timediff_ms = timediff_us / 1000;
-		sr_spew("Waited %" PRIi64 "ms.", timediff_ms);
+	return res;
+}
+
+/*
+ * Virtual device replaying a raw bulk stream file instead of the hardware.
+ */
+static struct sr_dev_inst* replay_dev_new(const char *path) {
+	struct dev_context *devc;
+	struct sr_dev_inst *sdi;
+	struct sr_channel *ch;
+	struct sr_channel_group *cg;
+	char channel_name[32];
+	unsigned int j;
+
+	devc = kingst_laxxxx_dev_new(vendor_id, vendor_name);
+	devc->replay_path = g_strdup(path);
+	devc->samplerates = samplerates;
+	devc->num_samplerates = ARRAY_SIZE(samplerates);
+
+	sdi = g_malloc0(sizeof(struct sr_dev_inst));
+	sdi->inst_type = SR_INST_USER;
+	sdi->status = SR_ST_INACTIVE;
+	sdi->vendor = g_strdup(vendor_name);
+	sdi->model = g_strdup("Replay");
+	sdi->version = g_strdup("");
+	sdi->connection_id = g_strdup(path);
+
+	cg = g_malloc0(sizeof(struct sr_channel_group));
+	cg->name = g_strdup("Logic");
+	for (j = 0; j < 16; j++) {
+		sprintf(channel_name, "D%d", j);
+		ch = sr_channel_new(sdi, j, SR_CHANNEL_LOGIC, TRUE, channel_name);
+		cg->channels = g_slist_append(cg->channels, ch);
 	}
+	sdi->channel_groups = g_slist_append(NULL, cg);
 
-	if (ret) {
-		if (res) {
-			libusb_close(res);
-			res = NULL;
-		}
+	sdi->priv = devc;
+
+	return sdi;
+}
+
+#ifdef KINGST_LAXXXX_EMULATOR
+/*
+ * Software emulated device, it goes through the same USB requests as
+ * the hardware.
+ */
+static struct sr_dev_inst* emulator_dev_new(const char *options) {
+	struct libusb_device_handle *hdl;
+	struct kingst_laxxxx_desc *device_desc;
+	struct dev_context *devc;
+	struct sr_dev_inst *sdi;
+	struct sr_channel *ch;
+	struct sr_channel_group *cg;
+	char channel_name[32];
+	unsigned int j;
+
+	if (!(hdl = kingst_laxxxx_emulator_open(options)))
+		return NULL;
+
+	if (kingst_laxxxx_has_fx_firmware(hdl, &device_desc) != SR_OK) {
+		sr_err("Emulated device doesn't answer.");
+		return NULL;
 	}
-	return res;
+
+	devc = kingst_laxxxx_dev_new(vendor_id, vendor_name);
+	devc->emulator = hdl;
+	/* The emulator has no usbfs memory. */
+	devc->dev_mem_failed = TRUE;
+	devc->profile.description = device_desc;
+	devc->samplerates = samplerates;
+	devc->num_samplerates = ARRAY_SIZE(samplerates);
+	devc->pwm[0].freq = 1000;
+	devc->pwm[0].duty = 50;
+	devc->pwm[1].freq = 1000;
+	devc->pwm[1].duty = 50;
+
+	sdi = g_malloc0(sizeof(struct sr_dev_inst));
+	sdi->inst_type = SR_INST_USB;
+	sdi->conn = sr_usb_dev_inst_new(0, 0, NULL);
+	sdi->status = SR_ST_INACTIVE;
+	sdi->vendor = g_strdup(vendor_name);
+	sdi->model = g_strdup(device_desc->model);
+	sdi->version = g_strdup("");
+	sdi->serial_num = g_strdup("emulator");
+	sdi->connection_id = g_strdup("emulator");
+
+	cg = g_malloc0(sizeof(struct sr_channel_group));
+	cg->name = g_strdup("Logic");
+	for (j = 0; j < device_desc->num_logic_channels; j++) {
+		sprintf(channel_name, "D%d", j);
+		ch = sr_channel_new(sdi, j, SR_CHANNEL_LOGIC, TRUE, channel_name);
+		cg->channels = g_slist_append(cg->channels, ch);
+	}
+	sdi->channel_groups = g_slist_append(NULL, cg);
+
+	sdi->priv = devc;
+
+	return sdi;
 }
+#endif
 
 static GSList* scan(struct sr_dev_driver *di, GSList *options) {
 
@@ -180,7 +365,10 @@ static GSList* scan(struct sr_dev_driver *di, GSList *options) {
 	libusb_device **devlist;
 	struct libusb_device_handle *hdl;
 	int ret, i, device_count;
-	const char *conn;
+	const char *conn, *replay_path;
+#ifdef KINGST_LAXXXX_EMULATOR
+	const char *emulator_options;
+#endif
 	char serial_num[64], connection_id[64];
 	char channel_name[32];
 	unsigned int j;
@@ -206,6 +394,20 @@ static GSList* scan(struct sr_dev_driver *di, GSList *options) {
 
 	/* Find all Kingst LA1010 compatible devices and upload firmware to them. */
 	devices = NULL;
+
+	replay_path = g_getenv(REPLAY_FILE_ENV);
+	if (replay_path && *replay_path)
+		devices = g_slist_append(devices, replay_dev_new(replay_path));
+
+#ifdef KINGST_LAXXXX_EMULATOR
+	emulator_options = g_getenv(EMULATOR_ENV);
+	if (emulator_options && *emulator_options
+			&& (sdi = emulator_dev_new(emulator_options))) {
+		devices = g_slist_append(devices, sdi);
+		sdi = NULL;
+	}
+#endif
+
 	device_count = libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
 	if (device_count > 0) {
 		for (i = 0; i < device_count; i++) {
@@ -380,6 +582,9 @@ static int dev_open(struct sr_dev_inst *sdi) {
 	devc = sdi->priv;
 	usb = sdi->conn;
 
+	if (devc->replay_path)
+		return SR_OK;
+
 	/*
 	 * If the firmware was recently uploaded, wait up to MAX_RENUM_DELAY_MS
 	 * milliseconds for the FX2 to renumerate.
@@ -390,7 +595,8 @@ static int dev_open(struct sr_dev_inst *sdi) {
 		return SR_ERR;
 	}
 
-	ret = libusb_claim_interface(usb->devhdl, USB_INTERFACE);
+	ret = kingst_laxxxx_usb_ops(usb->devhdl)->claim_interface(usb->devhdl,
+			USB_INTERFACE);
 	if (ret != 0) {
 		switch (ret) {
 		case LIBUSB_ERROR_BUSY:
@@ -437,13 +643,18 @@ static int dev_close(struct sr_dev_inst *sdi) {
 
 	usb = sdi->conn;
 
+	if (!usb)
+		return SR_OK;
+
 	if (!usb->devhdl)
 		return SR_ERR_BUG;
 
 	sr_info("Closing device on %d.%d (logical) / %s (physical) interface %d.",
 			usb->bus, usb->address, sdi->connection_id, USB_INTERFACE);
-	libusb_release_interface(usb->devhdl, USB_INTERFACE);
-	libusb_close(usb->devhdl);
+	kingst_laxxxx_free_transfers(sdi);
+	kingst_laxxxx_usb_ops(usb->devhdl)->release_interface(usb->devhdl,
+			USB_INTERFACE);
+	kingst_laxxxx_usb_ops(usb->devhdl)->close(usb->devhdl);
 	usb->devhdl = NULL;
 
 	return SR_OK;
@@ -476,12 +687,61 @@ static int config_get(uint32_t key, GVariant **data,
 	case SR_CONF_LIMIT_SAMPLES:
 		*data = g_variant_new_uint64(devc->limit_samples);
 		break;
+	case SR_CONF_LIMIT_FRAMES:
+		*data = g_variant_new_uint64(devc->limit_frames);
+		break;
 	case SR_CONF_SAMPLERATE:
 		*data = g_variant_new_uint64(devc->cur_samplerate);
 		break;
 	case SR_CONF_CAPTURE_RATIO:
 		*data = g_variant_new_uint64(devc->capture_ratio);
 		break;
+	case SR_CONF_BUFFERSIZE:
+		*data = g_variant_new_uint64(devc->buffer_size);
+		break;
+	case SR_CONF_TRANSFER_SIZE:
+		*data = g_variant_new_uint64(devc->tunables.transfer_size);
+		break;
+	case SR_CONF_NUM_TRANSFERS:
+		*data = g_variant_new_uint64(devc->tunables.num_transfers);
+		break;
+	case SR_CONF_AUTOTUNE:
+		*data = g_variant_new_boolean(devc->tunables.autotune);
+		break;
+	case SR_CONF_PIPELINE_DEPTH:
+		*data = g_variant_new_uint64(devc->tunables.pipeline_depth);
+		break;
+	case SR_CONF_OVERLOAD_POLICY:
+		*data = g_variant_new_string(
+				kingst_laxxxx_overload_names[devc->tunables.overload]);
+		break;
+	case SR_CONF_MAX_LATENCY:
+		*data = g_variant_new_uint64(devc->tunables.max_latency);
+		break;
+	case SR_CONF_PACKET_SIZE:
+		*data = g_variant_new_uint64(devc->tunables.packet_size);
+		break;
+	case SR_CONF_PACKET_AGE:
+		*data = g_variant_new_uint64(devc->tunables.packet_age);
+		break;
+	case SR_CONF_USB_THREAD:
+		*data = g_variant_new_boolean(devc->tunables.usb_thread);
+		break;
+	case SR_CONF_PIPELINE_OCCUPANCY:
+		*data = g_variant_new_uint64(kingst_laxxxx_pipeline_occupancy(sdi));
+		break;
+	case SR_CONF_PIPELINE_HIGH_WATER:
+		*data = g_variant_new_uint64(devc->pipeline_max_queued);
+		break;
+	case SR_CONF_PIPELINE_OVERFLOWS:
+		*data = g_variant_new_uint64(devc->pipeline_overflows);
+		break;
+	case SR_CONF_DROPPED_BYTES:
+		*data = g_variant_new_uint64(devc->pipeline_dropped_bytes);
+		break;
+	case SR_CONF_FAILED_TRANSFERS:
+		*data = g_variant_new_uint64(devc->failed_transfers);
+		break;
 	case SR_CONF_VOLTAGE_THRESHOLD:
 		if (!sdi)
 			return SR_ERR;
@@ -523,15 +783,55 @@ static int config_set(uint32_t key, GVariant *data,
 	case SR_CONF_LIMIT_SAMPLES:
 		devc->limit_samples = g_variant_get_uint64(data);
 		break;
+	case SR_CONF_LIMIT_FRAMES:
+		/* Segments of 'limit_samples' captured in one stream, 0 -- off */
+		devc->limit_frames = g_variant_get_uint64(data);
+		break;
 	case SR_CONF_CAPTURE_RATIO:
 		devc->capture_ratio = g_variant_get_uint64(data);
 		break;
+	case SR_CONF_BUFFERSIZE:
+		/* Limit of the USB transfer buffers, 0 -- computed from the rate */
+		devc->buffer_size = g_variant_get_uint64(data);
+		break;
+	case SR_CONF_TRANSFER_SIZE:
+		/* Rounded up to whole packets, 0 -- computed from the rate */
+		devc->tunables.transfer_size = g_variant_get_uint64(data);
+		break;
+	case SR_CONF_NUM_TRANSFERS:
+		devc->tunables.num_transfers = g_variant_get_uint64(data);
+		break;
+	case SR_CONF_AUTOTUNE:
+		devc->tunables.autotune = g_variant_get_boolean(data);
+		break;
+	case SR_CONF_PIPELINE_DEPTH:
+		devc->tunables.pipeline_depth = g_variant_get_uint64(data);
+		break;
+	case SR_CONF_OVERLOAD_POLICY:
+		if ((idx = std_str_idx(data,
+				ARRAY_AND_SIZE(kingst_laxxxx_overload_names))) < 0)
+			return SR_ERR_ARG;
+		devc->tunables.overload = idx;
+		break;
+	case SR_CONF_MAX_LATENCY:
+		devc->tunables.max_latency = g_variant_get_uint64(data);
+		break;
+	case SR_CONF_PACKET_SIZE:
+		devc->tunables.packet_size = g_variant_get_uint64(data);
+		break;
+	case SR_CONF_PACKET_AGE:
+		devc->tunables.packet_age = g_variant_get_uint64(data);
+		break;
+	case SR_CONF_USB_THREAD:
+		devc->tunables.usb_thread = g_variant_get_boolean(data);
+		break;
 	case SR_CONF_VOLTAGE_THRESHOLD:
 		if ((idx = std_double_tuple_idx(data, ARRAY_AND_SIZE(thresholds))) < 0)
 			return SR_ERR_ARG;
 		devc->selected_voltage_level = idx;
 		usb = sdi->conn;
-		kingst_laxxxx_set_logic_level(usb->devhdl, thresholds[idx][0]);
+		if (usb)
+			kingst_laxxxx_set_logic_level(usb->devhdl, thresholds[idx][0]);
 		break;
 	default:
 		return SR_ERR_NA;
@@ -564,6 +864,9 @@ static int config_list(uint32_t key, GVariant **data,
 		case SR_CONF_TRIGGER_MATCH:
 			*data = std_gvar_array_i32(ARRAY_AND_SIZE(trigger_matches));
 			break;
+		case SR_CONF_OVERLOAD_POLICY:
+			*data = g_variant_new_strv(ARRAY_AND_SIZE(kingst_laxxxx_overload_names));
+			break;
 		default:
 			return SR_ERR_NA;
 		}
@@ -574,6 +877,21 @@ static int config_list(uint32_t key, GVariant **data,
 	return SR_OK;
 }
 
+static void clear_helper(struct dev_context *devc) {
+	g_mutex_clear(&devc->send_mutex);
+	g_free(devc->replay_path);
+	g_free(devc->spartan_hash);
+}
+
+static int dev_clear(const struct sr_dev_driver *di) {
+	return std_dev_clear_with_callback(di, (std_dev_clear_callback) clear_helper);
+}
+
+static int cleanup(const struct sr_dev_driver *di) {
+	kingst_laxxxx_firmware_cache_free();
+	return std_cleanup(di);
+}
+
 static int dev_acquisition_start(const struct sr_dev_inst *sdi) {
 	sr_dbg("dev_acquisition_start(): start sampling");
 	return kingst_laxxxx_acquisition_start(sdi);
@@ -586,8 +904,8 @@ static int dev_acquisition_stop(struct sr_dev_inst *sdi) {
 
 SR_PRIV struct sr_dev_driver kingst_la1010_driver_info = { .name =
 		"kingst-la1010", .longname = "Kingst LA1010", .api_version = 1, .init =
-		std_init, .cleanup = std_cleanup, .scan = scan,
-		.dev_list = std_dev_list, .dev_clear = std_dev_clear, .config_get =
+		std_init, .cleanup = cleanup, .scan = scan,
+		.dev_list = std_dev_list, .dev_clear = dev_clear, .config_get =
 				config_get, .config_set = config_set,
 		.config_list = config_list, .dev_open = dev_open,
 		.dev_close = dev_close, .dev_acquisition_start = dev_acquisition_start,
@@ -0,0 +1,429 @@
+/*
+ * This file is part of the libsigrok project.
+ *
+ * Copyright (C) 2018 Alexandr Ugnenko <ugnenko@mail.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.	If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of the host side of the driver, no device is needed:
+ * sample conversion with every engine the CPU supports, the soft trigger
+ * on converted samples and the Intel HEX parser.
+ *
+ * It isn't a part of the driver and is linked statically against the
+ * libsigrok it's built in, for the driver's private functions. From the
+ * top of a libsigrok tree configured with '--enable-static':
+ *
+ *   make kingst-la1010-bench
+ *
+ * Usage:
+ *
+ *   kingst-la1010-bench [-f csv|json] [-c 1,2,3,4,8,16]
+ *                       [-r 16000000,50000000,100000000] [-s 65536,...]
+ *                       [-t 0.2]
+ *
+ * Transfer sizes are the ones the driver uses at the given samplerates,
+ * or the sizes given with '-s'. Every result is a line of CSV (with a
+ * header) or a JSON object in an array. Cycles are the time stamp counter
+ * ticks on x86, -1 elsewhere.
+ */
+
+#include <config.h>
+#include <inttypes.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include "protocol.h"
+
+struct bench_result {
+	const char *benchmark;
+	const char *engine;
+	int channels;
+	uint64_t samplerate;
+	size_t transfer_size;
+	uint64_t bytes;
+	uint64_t samples;
+	double seconds;
+	int64_t cycles;
+};
+
+static gchar *opt_format = "csv";
+static gchar *opt_channels = "1,2,3,4,8,16";
+static gchar *opt_samplerates = "16000000,50000000,100000000";
+static gchar *opt_sizes = NULL;
+static gdouble opt_time = 0.2;
+
+static GOptionEntry bench_options[] = {
+	{ "format", 'f', 0, G_OPTION_ARG_STRING, &opt_format,
+		"Output format: csv or json", "FORMAT" },
+	{ "channels", 'c', 0, G_OPTION_ARG_STRING, &opt_channels,
+		"Numbers of enabled channels", "LIST" },
+	{ "samplerates", 'r', 0, G_OPTION_ARG_STRING, &opt_samplerates,
+		"Samplerates giving the transfer sizes", "LIST" },
+	{ "sizes", 's', 0, G_OPTION_ARG_STRING, &opt_sizes,
+		"Transfer sizes in bytes instead of the samplerates", "LIST" },
+	{ "time", 't', 0, G_OPTION_ARG_DOUBLE, &opt_time,
+		"Minimal time of every measurement in seconds", "SECONDS" },
+	{ NULL, 0, 0, 0, NULL, NULL, NULL }
+};
+
+static int num_results;
+
+static int64_t read_cycles(void) {
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	return -1;
+#endif
+}
+
+static void print_result(const struct bench_result *r) {
+	double gbps, ns_per_sample, cycles_per_byte;
+
+	gbps = r->bytes / r->seconds / 1e9;
+	ns_per_sample = r->samples ? r->seconds * 1e9 / r->samples : -1;
+	cycles_per_byte = r->cycles >= 0 ? (double) r->cycles / r->bytes : -1;
+
+	if (!strcmp(opt_format, "json")) {
+		printf("%s{\"benchmark\": \"%s\", \"engine\": \"%s\", \"channels\": %d, "
+				"\"samplerate\": %" PRIu64 ", \"transfer_size\": %zu, "
+				"\"bytes\": %" PRIu64 ", \"samples\": %" PRIu64 ", "
+				"\"seconds\": %.6f, \"gb_per_s\": %.4f, "
+				"\"ns_per_sample\": %.4f, \"cycles_per_byte\": %.4f}",
+				num_results ? ",\n  " : "[\n  ",
+				r->benchmark, r->engine, r->channels, r->samplerate,
+				r->transfer_size, r->bytes, r->samples, r->seconds, gbps,
+				ns_per_sample, cycles_per_byte);
+	} else {
+		if (!num_results)
+			printf("benchmark,engine,channels,samplerate,transfer_size,bytes,"
+					"samples,seconds,gb_per_s,ns_per_sample,cycles_per_byte\n");
+		printf("%s,%s,%d,%" PRIu64 ",%zu,%" PRIu64 ",%" PRIu64 ",%.6f,%.4f,"
+				"%.4f,%.4f\n",
+				r->benchmark, r->engine, r->channels, r->samplerate,
+				r->transfer_size, r->bytes, r->samples, r->seconds, gbps,
+				ns_per_sample, cycles_per_byte);
+	}
+	num_results++;
+}
+
+static uint64_t *parse_list(const char *list, int *count) {
+	gchar **items;
+	uint64_t *values;
+	int i;
+
+	items = g_strsplit(list, ",", 0);
+	*count = g_strv_length(items);
+	values = g_new0(uint64_t, *count);
+	for (i = 0; i < *count; i++)
+		values[i] = g_ascii_strtoull(items[i], NULL, 0);
+	g_strfreev(items);
+
+	return values;
+}
+
+/* Bulk data with random words, the first enabled channel is kept low. */
+static uint8_t *make_stream(size_t size, int num_channels) {
+	uint8_t *buffer;
+	uint32_t seed = 0x4B494E47;
+	size_t i;
+
+	buffer = g_malloc(size);
+	for (i = 0; i < size / 2; i++) {
+		seed = seed * 1103515245 + 12345;
+		if (i % num_channels == 0)
+			seed &= 0xFFFF0000;
+		buffer[i * 2] = seed >> 16;
+		buffer[i * 2 + 1] = seed >> 24;
+	}
+
+	return buffer;
+}
+
+static void setup_channels(struct dev_context *devc, int num_channels,
+							int unitsize) {
+	int c;
+
+	devc->num_channels = num_channels;
+	devc->cur_channels = 0;
+	for (c = 0; c < num_channels; c++) {
+		devc->channel_masks[c] = 1 << c;
+		devc->cur_channels |= 1 << c;
+	}
+	devc->cur_channel = 0;
+	memset(devc->channel_data, 0, 16 * 2);
+	devc->unitsize = unitsize;
+}
+
+/* Convert a block into convbuffer, counting the samples instead of sending. */
+static gboolean convert_block(const struct sr_dev_inst *sdi,
+								const uint8_t *buffer,
+								size_t length) {
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+	devc->sent_samples += kingst_laxxxx_convert_sample_data(devc,
+			devc->convbuffer, devc->convbuffer_size, buffer, length);
+
+	return TRUE;
+}
+
+/* The block walk of the driver, without the session. */
+static uint64_t convert_transfer(const struct sr_dev_inst *sdi,
+								const uint8_t *buffer,
+								size_t length) {
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+	devc->sent_samples = 0;
+	kingst_laxxxx_walk_sample_data(sdi, buffer, length, convert_block, NULL);
+
+	return devc->sent_samples;
+}
+
+static void bench_convert(const struct sr_dev_inst *sdi,
+							const struct convert_engine *engine,
+							int num_channels,
+							uint64_t samplerate,
+							size_t size) {
+	struct dev_context *devc;
+	struct bench_result r;
+	uint8_t *buffer;
+	int64_t start, cycles;
+
+	devc = sdi->priv;
+
+	setup_channels(devc, num_channels, num_channels > 8 ? 2 : 1);
+	devc->transpose_groups = engine->specialized[num_channels];
+	if (!devc->transpose_groups)
+		devc->transpose_groups = engine->transpose;
+
+	buffer = make_stream(size, num_channels);
+
+	memset(&r, 0, sizeof(r));
+	r.benchmark = devc->unitsize == 1 ? "convert8" : "convert16";
+	r.engine = engine->name;
+	r.channels = num_channels;
+	r.samplerate = samplerate;
+	r.transfer_size = size;
+
+	/* Warm up the caches and the page tables. */
+	convert_transfer(sdi, buffer, size);
+
+	start = g_get_monotonic_time();
+	cycles = read_cycles();
+	do {
+		r.samples += convert_transfer(sdi, buffer, size);
+		r.bytes += size;
+	} while (g_get_monotonic_time() - start < opt_time * G_USEC_PER_SEC);
+	r.cycles = cycles >= 0 ? read_cycles() - cycles : -1;
+	r.seconds = (double) (g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+
+	print_result(&r);
+
+	g_free(buffer);
+}
+
+static void bench_trigger(const struct sr_dev_inst *sdi,
+							int num_channels,
+							uint64_t samplerate,
+							size_t size) {
+	struct dev_context *devc;
+	struct sr_trigger *trigger;
+	struct sr_trigger_stage *stage;
+	struct soft_trigger_logic *stl;
+	struct bench_result r;
+	uint8_t *buffer, *samples;
+	uint64_t num_samples;
+	int64_t start, cycles;
+	int pre_trigger_samples;
+
+	devc = sdi->priv;
+
+	/* The soft trigger always gets 16-bit samples from the driver. */
+	setup_channels(devc, num_channels, 2);
+	devc->transpose_groups = kingst_laxxxx_get_convert_engine()->transpose;
+
+	buffer = make_stream(size, num_channels);
+	samples = g_malloc((size / 2 / num_channels + 1) * 16 * 2);
+	num_samples = kingst_laxxxx_convert_sample_data(devc, samples,
+			(size / 2 / num_channels + 1) * 16 * 2, buffer, size);
+
+	/* Rising edge of the first channel, it never comes. */
+	trigger = sr_trigger_new(NULL);
+	stage = sr_trigger_stage_add(trigger);
+	sr_trigger_match_add(stage, sdi->channels->data, SR_TRIGGER_RISING, 0);
+	stl = soft_trigger_logic_new(sdi, trigger, 0);
+
+	memset(&r, 0, sizeof(r));
+	r.benchmark = "trigger";
+	r.engine = "soft";
+	r.channels = num_channels;
+	r.samplerate = samplerate;
+	r.transfer_size = size;
+
+	start = g_get_monotonic_time();
+	cycles = read_cycles();
+	do {
+		soft_trigger_logic_check(stl, samples, num_samples * 2,
+				&pre_trigger_samples);
+		r.samples += num_samples;
+		r.bytes += num_samples * 2;
+	} while (g_get_monotonic_time() - start < opt_time * G_USEC_PER_SEC);
+	r.cycles = cycles >= 0 ? read_cycles() - cycles : -1;
+	r.seconds = (double) (g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+
+	print_result(&r);
+
+	soft_trigger_logic_free(stl);
+	sr_trigger_free(trigger);
+	g_free(samples);
+	g_free(buffer);
+}
+
+/* Intel HEX image of 'size' bytes in records of 16 bytes. */
+static GString *make_hex(size_t size) {
+	GString *hex;
+	uint8_t checksum, data;
+	size_t addr;
+	int i;
+
+	hex = g_string_new(NULL);
+	for (addr = 0; addr < size; addr += 16) {
+		g_string_append_printf(hex, ":10%04X00", (unsigned int) addr & 0xFFFF);
+		checksum = 0x10 + (addr >> 8) + addr;
+		for (i = 0; i < 16; i++) {
+			data = (addr + i) * 7;
+			g_string_append_printf(hex, "%02X", data);
+			checksum += data;
+		}
+		g_string_append_printf(hex, "%02X\r\n", (uint8_t) (0 - checksum));
+	}
+	g_string_append(hex, ":00000001FF\r\n");
+
+	return hex;
+}
+
+static void bench_hex(size_t size) {
+	struct bench_result r;
+	GString *hex;
+	unsigned char buffer[0x10];
+	size_t offset;
+	uint16_t addr;
+	int64_t start, cycles;
+	int res;
+
+	hex = make_hex(size);
+
+	memset(&r, 0, sizeof(r));
+	r.benchmark = "hex";
+	r.engine = "read_hex_line";
+	r.transfer_size = hex->len;
+
+	start = g_get_monotonic_time();
+	cycles = read_cycles();
+	do {
+		offset = 0;
+		while ((res = kingst_laxxxx_read_hex_line((unsigned char*) hex->str,
+				hex->len, &offset, &addr, buffer)) > 0)
+			;
+		if (res < 0) {
+			fprintf(stderr, "Failed to parse the HEX image.\n");
+			break;
+		}
+		r.bytes += hex->len;
+	} while (g_get_monotonic_time() - start < opt_time * G_USEC_PER_SEC);
+	r.cycles = cycles >= 0 ? read_cycles() - cycles : -1;
+	r.seconds = (double) (g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+
+	if (r.bytes)
+		print_result(&r);
+
+	g_string_free(hex, TRUE);
+}
+
+int main(int argc, char **argv) {
+	GOptionContext *context;
+	GError *error = NULL;
+	struct sr_dev_inst sdi;
+	struct dev_context devc;
+	const struct convert_engine *engines;
+	uint64_t *channels, *samplerates, *sizes;
+	size_t size;
+	int num_channels, num_samplerates, num_sizes, c, i;
+	unsigned int num_engines, e;
+	char name[8];
+
+	context = g_option_context_new("- Kingst LAxxxx driver microbenchmarks");
+	g_option_context_add_main_entries(context, bench_options, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(context);
+
+	channels = parse_list(opt_channels, &num_channels);
+	samplerates = parse_list(opt_samplerates, &num_samplerates);
+	sizes = opt_sizes ? parse_list(opt_sizes, &num_sizes) : NULL;
+
+	memset(&sdi, 0, sizeof(sdi));
+	memset(&devc, 0, sizeof(devc));
+	sdi.priv = &devc;
+	for (c = 0; c < 16; c++) {
+		snprintf(name, sizeof(name), "D%d", c);
+		sr_channel_new(&sdi, c, SR_CHANNEL_LOGIC, TRUE, name);
+	}
+
+	devc.convbuffer_size = CONVERT_BLOCK_SIZE;
+	devc.convbuffer = g_malloc(devc.convbuffer_size);
+
+	/* Selects the default engine and fills the lookup table. */
+	kingst_laxxxx_get_convert_engine();
+	engines = kingst_laxxxx_convert_engines(&num_engines);
+
+	for (c = 0; c < num_channels; c++) {
+		if (channels[c] < 1 || channels[c] > 16)
+			continue;
+		for (i = 0; i < (sizes ? num_sizes : num_samplerates); i++) {
+			devc.num_channels = channels[c];
+			devc.cur_samplerate = sizes ? 0 : samplerates[i];
+			size = sizes ? sizes[i] : kingst_laxxxx_get_buffer_size(&devc);
+
+			for (e = 0; e < num_engines; e++) {
+				if (engines[e].is_supported && !engines[e].is_supported())
+					continue;
+				bench_convert(&sdi, &engines[e], channels[c],
+						devc.cur_samplerate, size);
+			}
+			bench_trigger(&sdi, channels[c], devc.cur_samplerate, size);
+		}
+	}
+
+	bench_hex(16 * 1024);
+	bench_hex(512 * 1024);
+
+	if (!strcmp(opt_format, "json"))
+		printf("%s]\n", num_results ? "\n" : "[");
+
+	g_free(devc.convbuffer);
+	g_slist_free_full(sdi.channels, (GDestroyNotify) sr_channel_free_cb);
+	g_free(channels);
+	g_free(samplerates);
+	g_free(sizes);
+
+	return 0;
+}
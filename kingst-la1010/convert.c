@@ -0,0 +1,705 @@
+/*
+ * This file is part of the libsigrok project.
+ *
+ * Copyright (C) 2018 Alexandr Ugnenko <ugnenko@mail.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.	If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_CONVERT_ENGINES
+#endif
+
+#include "protocol.h"
+
+/*
+ * Sampling data same as Saleae Logic16.
+ *
+ * Each 16-bit word from the device holds 16 consecutive samples of one
+ * enabled channel; a group of 'num_channels' words gives 16 samples of
+ * all enabled channels. A group may be split between two transfers, the
+ * incomplete part is kept in 'devc->channel_data' / 'devc->cur_channel'.
+ */
+static inline void convert_word(uint16_t *channel_data,
+								uint16_t sample,
+								uint16_t channel_mask) {
+	int i;
+
+	for (i = 0; i < 16; ++i, sample >>= 1)
+		if (sample & 1)
+			channel_data[i] |= channel_mask;
+}
+
+/*
+ * Conversion engines.
+ *
+ * Every engine transposes 'num_groups' full groups from 'src' to 'dest'
+ * and must produce exactly the same output as transpose_groups_ref().
+ * The engine is chosen once per process by kingst_laxxxx_get_convert_engine():
+ * all engines supported by the CPU are checked against the reference and
+ * the fastest passed one is used. The choice can be forced with the
+ * KINGST_LAXXXX_CONVERT_ENGINE environment variable.
+ *
+ * Engine kernels are always inlined into a generic function and into
+ * functions specialized for the common numbers of enabled channels, so the
+ * group size is a constant and the per-channel loop is unrolled.
+ */
+
+#define TRANSPOSE_GROUPS_VARIANT(engine, n, attr) \
+	attr static void transpose_groups_##engine##_##n(const uint16_t *channel_masks, \
+			int num_channels, uint8_t *dest, const uint8_t *src, size_t num_groups) { \
+		(void) num_channels; \
+		transpose_##engine(channel_masks, n, dest, src, num_groups); \
+	}
+
+#define TRANSPOSE_GROUPS_VARIANTS(engine, attr) \
+	attr static void transpose_groups_##engine(const uint16_t *channel_masks, \
+			int num_channels, uint8_t *dest, const uint8_t *src, size_t num_groups) { \
+		transpose_##engine(channel_masks, num_channels, dest, src, num_groups); \
+	} \
+	TRANSPOSE_GROUPS_VARIANT(engine, 1, attr) \
+	TRANSPOSE_GROUPS_VARIANT(engine, 2, attr) \
+	TRANSPOSE_GROUPS_VARIANT(engine, 3, attr) \
+	TRANSPOSE_GROUPS_VARIANT(engine, 4, attr) \
+	TRANSPOSE_GROUPS_VARIANT(engine, 8, attr) \
+	TRANSPOSE_GROUPS_VARIANT(engine, 16, attr)
+
+#define TRANSPOSE_GROUPS_ENGINE(engine) \
+	transpose_groups_##engine, { \
+		[1] = transpose_groups_##engine##_1, \
+		[2] = transpose_groups_##engine##_2, \
+		[3] = transpose_groups_##engine##_3, \
+		[4] = transpose_groups_##engine##_4, \
+		[8] = transpose_groups_##engine##_8, \
+		[16] = transpose_groups_##engine##_16, \
+	}
+
+static void transpose_groups_ref(const uint16_t *channel_masks,
+									int num_channels,
+									uint8_t *dest,
+									const uint8_t *src,
+									size_t num_groups) {
+	uint16_t channel_data[16];
+	int c;
+
+	while (num_groups--) {
+		memset(channel_data, 0, 16 * 2);
+		for (c = 0; c < num_channels; c++, src += 2)
+			convert_word(channel_data, src[0] | (src[1] << 8), channel_masks[c]);
+		memcpy(dest, channel_data, 16 * 2);
+		dest += 16 * 2;
+	}
+}
+
+/*
+ * Portable engine: every byte of a channel word is expanded through a
+ * 256-entry table to 8 'all ones / all zeros' sample masks.
+ */
+static uint16_t bit_lut[256][8];
+
+static void init_bit_lut(void) {
+	int b, i;
+
+	for (b = 0; b < 256; b++)
+		for (i = 0; i < 8; i++)
+			bit_lut[b][i] = (b >> i) & 1 ? 0xFFFF : 0;
+}
+
+static inline __attribute__((always_inline))
+void transpose_lut(const uint16_t *channel_masks,
+					int num_channels,
+					uint8_t *dest,
+					const uint8_t *src,
+					size_t num_groups) {
+	uint16_t channel_data[16], masks[16], channel_mask;
+	const uint16_t *lo, *hi;
+	int c, i;
+
+	memcpy(masks, channel_masks, num_channels * 2);
+
+	while (num_groups--) {
+		memset(channel_data, 0, 16 * 2);
+		for (c = 0; c < num_channels; c++, src += 2) {
+			lo = bit_lut[src[0]];
+			hi = bit_lut[src[1]];
+			channel_mask = masks[c];
+			for (i = 0; i < 8; i++) {
+				channel_data[i] |= lo[i] & channel_mask;
+				channel_data[i + 8] |= hi[i] & channel_mask;
+			}
+		}
+		memcpy(dest, channel_data, 16 * 2);
+		dest += 16 * 2;
+	}
+}
+
+TRANSPOSE_GROUPS_VARIANTS(lut, )
+
+#ifdef HAVE_X86_CONVERT_ENGINES
+
+static gboolean cpu_has_sse2(void) {
+	return __builtin_cpu_supports("sse2") ? TRUE : FALSE;
+}
+
+static gboolean cpu_has_avx2(void) {
+	return __builtin_cpu_supports("avx2") ? TRUE : FALSE;
+}
+
+static gboolean cpu_has_avx512_gfni(void) {
+	return (__builtin_cpu_supports("avx512f")
+			&& __builtin_cpu_supports("avx512bw")
+			&& __builtin_cpu_supports("avx512vl")
+			&& __builtin_cpu_supports("gfni")) ? TRUE : FALSE;
+}
+
+/*
+ * The 16 output samples of a group are split between two 128-bit
+ * registers. Every channel word is broadcast, tested against the
+ * per-sample bit and merged with the channel mask.
+ */
+static inline __attribute__((always_inline, target("sse2")))
+void transpose_sse2(const uint16_t *channel_masks,
+					int num_channels,
+					uint8_t *dest,
+					const uint8_t *src,
+					size_t num_groups) {
+	const __m128i bits_lo = _mm_setr_epi16(0x0001, 0x0002, 0x0004, 0x0008,
+											0x0010, 0x0020, 0x0040, 0x0080);
+	const __m128i bits_hi = _mm_setr_epi16(0x0100, 0x0200, 0x0400, 0x0800,
+											0x1000, 0x2000, 0x4000, (short) 0x8000);
+	__m128i acc_lo, acc_hi, word, masks[16];
+	int c;
+
+	for (c = 0; c < num_channels; c++)
+		masks[c] = _mm_set1_epi16(channel_masks[c]);
+
+	while (num_groups--) {
+		acc_lo = _mm_setzero_si128();
+		acc_hi = _mm_setzero_si128();
+		for (c = 0; c < num_channels; c++, src += 2) {
+			word = _mm_set1_epi16(src[0] | (src[1] << 8));
+			acc_lo = _mm_or_si128(acc_lo,
+					_mm_and_si128(_mm_cmpeq_epi16(_mm_and_si128(word, bits_lo), bits_lo), masks[c]));
+			acc_hi = _mm_or_si128(acc_hi,
+					_mm_and_si128(_mm_cmpeq_epi16(_mm_and_si128(word, bits_hi), bits_hi), masks[c]));
+		}
+		_mm_storeu_si128((__m128i*) dest, acc_lo);
+		_mm_storeu_si128((__m128i*) (dest + 16), acc_hi);
+		dest += 16 * 2;
+	}
+}
+
+TRANSPOSE_GROUPS_VARIANTS(sse2, __attribute__((target("sse2"))))
+
+/*
+ * Same as the SSE2 engine, but all 16 output samples of a group are kept
+ * in one 256-bit register.
+ */
+static inline __attribute__((always_inline, target("avx2")))
+void transpose_avx2(const uint16_t *channel_masks,
+					int num_channels,
+					uint8_t *dest,
+					const uint8_t *src,
+					size_t num_groups) {
+	const __m256i bits = _mm256_setr_epi16(0x0001, 0x0002, 0x0004, 0x0008,
+											0x0010, 0x0020, 0x0040, 0x0080,
+											0x0100, 0x0200, 0x0400, 0x0800,
+											0x1000, 0x2000, 0x4000, (short) 0x8000);
+	__m256i acc, word, masks[16];
+	int c;
+
+	for (c = 0; c < num_channels; c++)
+		masks[c] = _mm256_set1_epi16(channel_masks[c]);
+
+	while (num_groups--) {
+		acc = _mm256_setzero_si256();
+		for (c = 0; c < num_channels; c++, src += 2) {
+			word = _mm256_set1_epi16(src[0] | (src[1] << 8));
+			word = _mm256_cmpeq_epi16(_mm256_and_si256(word, bits), bits);
+			acc = _mm256_or_si256(acc, _mm256_and_si256(word, masks[c]));
+		}
+		_mm256_storeu_si256((__m256i*) dest, acc);
+		dest += 16 * 2;
+	}
+}
+
+TRANSPOSE_GROUPS_VARIANTS(avx2, __attribute__((target("avx2"))))
+
+/*
+ * A group is a 16x16 bit matrix (rows -- channels, columns -- samples)
+ * and the output is its transpose. Channel words are placed at the rows
+ * of their channel index, the matrix is split into four 8x8 blocks and
+ * every block is transposed natively by GF2P8AFFINEQB. Two groups are
+ * processed per 512-bit register.
+ *
+ * With the 'x' operand byte 'j' set to (1 << j), result byte 'j' bit 'i'
+ * is bit 'j' of matrix byte (7 - i), so the blocks are built with
+ * reversed byte order. When the enabled channels are D0..Dn the rows are
+ * loaded directly, otherwise they are scattered by the channel masks,
+ * which must be single bits.
+ */
+static inline __attribute__((always_inline, target("avx512f,avx512bw,avx512vl,gfni")))
+void transpose_avx512_gfni(const uint16_t *channel_masks,
+							int num_channels,
+							uint8_t *dest,
+							const uint8_t *src,
+							size_t num_groups) {
+	const __m512i select = _mm512_set1_epi64(0x8040201008040201LL);
+	/* Per 128-bit lane: low bytes of 8 rows reversed, high bytes reversed */
+	const __m512i split = _mm512_broadcast_i32x4(_mm_setr_epi8(14, 12, 10, 8, 6, 4, 2, 0,
+																15, 13, 11, 9, 7, 5, 3, 1));
+	/* [rows 0-7 low, rows 8-15 low], [rows 0-7 high, rows 8-15 high] */
+	const __m512i blocks = _mm512_setr_epi64(0, 2, 1, 3, 4, 6, 5, 7);
+	const __mmask16 row_mask = (1 << num_channels) - 1;
+	uint8_t channel_index[16], out[64];
+	uint16_t rows[32];
+	gboolean direct;
+	__m256i group;
+	__m512i matrix;
+	size_t n;
+	int c, g;
+
+	direct = TRUE;
+	for (c = 0; c < num_channels; c++) {
+		channel_index[c] = __builtin_ctz(channel_masks[c]);
+		if (channel_masks[c] != 1 << c)
+			direct = FALSE;
+	}
+
+	while (num_groups) {
+		n = num_groups > 1 ? 2 : 1;
+		if (direct) {
+			group = n > 1 ? _mm256_maskz_loadu_epi16(row_mask, src + num_channels * 2)
+					: _mm256_setzero_si256();
+			matrix = _mm512_inserti64x4(
+					_mm512_castsi256_si512(_mm256_maskz_loadu_epi16(row_mask, src)),
+					group, 1);
+			src += n * num_channels * 2;
+		} else {
+			memset(rows, 0, sizeof(rows));
+			for (g = 0; g < (int) n; g++)
+				for (c = 0; c < num_channels; c++, src += 2)
+					rows[g * 16 + channel_index[c]] = src[0] | (src[1] << 8);
+			matrix = _mm512_loadu_si512(rows);
+		}
+		matrix = _mm512_shuffle_epi8(matrix, split);
+		matrix = _mm512_permutexvar_epi64(blocks, matrix);
+		matrix = _mm512_gf2p8affine_epi64_epi8(select, matrix, 0);
+		/* Interleave channels 0-7 and 8-15 bytes into 16-bit samples. */
+		matrix = _mm512_unpacklo_epi8(matrix, _mm512_bsrli_epi128(matrix, 8));
+		if (n == 2) {
+			_mm512_storeu_si512(dest, matrix);
+		} else {
+			_mm512_storeu_si512(out, matrix);
+			memcpy(dest, out, 16 * 2);
+		}
+		dest += n * 16 * 2;
+		num_groups -= n;
+	}
+}
+
+TRANSPOSE_GROUPS_VARIANTS(avx512_gfni, __attribute__((target("avx512f,avx512bw,avx512vl,gfni"))))
+
+#endif
+
+/* Engines in order of preference, the last passed one is used. */
+static const struct convert_engine convert_engines[] = {
+	{ "lut", NULL, TRANSPOSE_GROUPS_ENGINE(lut) },
+#ifdef HAVE_X86_CONVERT_ENGINES
+	{ "sse2", cpu_has_sse2, TRANSPOSE_GROUPS_ENGINE(sse2) },
+	{ "avx2", cpu_has_avx2, TRANSPOSE_GROUPS_ENGINE(avx2) },
+	{ "avx512-gfni", cpu_has_avx512_gfni, TRANSPOSE_GROUPS_ENGINE(avx512_gfni) },
+#endif
+};
+
+/*
+ * Check the engine against the reference with several channel
+ * configurations and group counts.
+ */
+static gboolean convert_engine_self_test(const struct convert_engine *engine) {
+	static const uint16_t test_channels[] = { 0x0001, 0x0300, 0x0007, 0x00A5,
+											0x8421, 0x5555, 0x7FFE, 0xFFFF };
+	transpose_groups_fn transpose;
+	uint8_t src[16 * 2 * 9], ref[16 * 2 * 9], out[16 * 2 * 9];
+	uint16_t channel_masks[16];
+	uint32_t seed = 0x4B494E47;
+	size_t num_groups, i;
+	int num_channels, c;
+	unsigned int t;
+
+	for (t = 0; t < ARRAY_SIZE(test_channels); t++) {
+		num_channels = 0;
+		for (c = 0; c < 16; c++)
+			if (test_channels[t] & (1 << c))
+				channel_masks[num_channels++] = 1 << c;
+
+		for (num_groups = 1; num_groups <= 9; num_groups++) {
+			for (i = 0; i < num_groups * num_channels * 2; i++) {
+				seed = seed * 1103515245 + 12345;
+				src[i] = seed >> 16;
+			}
+			transpose_groups_ref(channel_masks, num_channels, ref, src, num_groups);
+			memset(out, 0, sizeof(out));
+			engine->transpose(channel_masks, num_channels, out, src, num_groups);
+			if (memcmp(ref, out, num_groups * 16 * 2)) {
+				sr_err("Conversion engine '%s' self-test failed: channels %04X, groups %lu.",
+						engine->name, test_channels[t], num_groups);
+				return FALSE;
+			}
+			if (!(transpose = engine->specialized[num_channels]))
+				continue;
+			memset(out, 0, sizeof(out));
+			transpose(channel_masks, num_channels, out, src, num_groups);
+			if (memcmp(ref, out, num_groups * 16 * 2)) {
+				sr_err("Conversion engine '%s' self-test failed for %d channels: groups %lu.",
+						engine->name, num_channels, num_groups);
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+static gpointer select_convert_engine(gpointer data) {
+	const struct convert_engine *engine, *forced_engine;
+	const char *forced;
+	unsigned int i;
+
+	(void) data;
+
+	init_bit_lut();
+
+	forced = g_getenv(CONVERT_ENGINE_ENV);
+	engine = NULL;
+	forced_engine = NULL;
+	for (i = 0; i < ARRAY_SIZE(convert_engines); i++) {
+		if (convert_engines[i].is_supported
+				&& !convert_engines[i].is_supported()) {
+			sr_dbg("Conversion engine '%s' is not supported by CPU.",
+					convert_engines[i].name);
+			continue;
+		}
+		if (!convert_engine_self_test(&convert_engines[i]))
+			continue;
+		engine = &convert_engines[i];
+		if (forced && !g_ascii_strcasecmp(forced, engine->name))
+			forced_engine = engine;
+	}
+
+	if (forced) {
+		if (forced_engine)
+			engine = forced_engine;
+		else
+			sr_warn("Conversion engine '%s' is not available, using '%s'.",
+					forced, engine->name);
+	}
+
+	sr_info("Using '%s' conversion engine.", engine->name);
+
+	return (gpointer) engine;
+}
+
+/* Returns all engines built in, including the ones the CPU lacks. */
+SR_PRIV const struct convert_engine* kingst_laxxxx_convert_engines(unsigned int *count) {
+	*count = ARRAY_SIZE(convert_engines);
+
+	return convert_engines;
+}
+
+/*
+ * Returns the conversion engine for this process, it's selected on the
+ * first call.
+ */
+SR_PRIV const struct convert_engine* kingst_laxxxx_get_convert_engine(void) {
+	static GOnce engine_once = G_ONCE_INIT;
+
+	return g_once(&engine_once, select_convert_engine, NULL);
+}
+
+/* Number of groups narrowed at once through the stack buffer. */
+#define NARROW_CHUNK_GROUPS	64
+
+/*
+ * Convert full groups to samples of devc->unitsize bytes. 8-bit samples
+ * go through a small buffer, so the engines only produce 16-bit samples.
+ */
+static void convert_groups(struct dev_context *devc,
+							uint8_t *dest,
+							const uint8_t *src,
+							size_t num_groups) {
+	uint16_t samples[NARROW_CHUNK_GROUPS * 16];
+	size_t i, n;
+
+	if (devc->unitsize == 2) {
+		devc->transpose_groups(devc->channel_masks, devc->num_channels,
+				dest, src, num_groups);
+		return;
+	}
+
+	while (num_groups) {
+		n = MIN(num_groups, NARROW_CHUNK_GROUPS);
+		devc->transpose_groups(devc->channel_masks, devc->num_channels,
+				(uint8_t*) samples, src, n);
+		for (i = 0; i < n * 16; i++)
+			dest[i] = samples[i];
+		dest += n * 16;
+		src += n * devc->num_channels * 2;
+		num_groups -= n;
+	}
+}
+
+/*
+ * Data-parallel conversion.
+ *
+ * With KINGST_LAXXXX_CONVERT_THREADS set to more than 1 (0 -- number of
+ * CPUs), large runs of full groups are split into slices of whole groups
+ * and converted by a pool of threads, the calling thread converts the
+ * first slice. Every slice writes to its own part of the output, so no
+ * copying is needed; the partial group carry is handled by the caller.
+ */
+
+/* Don't split runs into slices of less than this number of groups. */
+#define CONVERT_SLICE_MIN_GROUPS	4096
+
+struct convert_slice {
+	struct dev_context *devc;
+	uint8_t *dest;
+	const uint8_t *src;
+	size_t num_groups;
+};
+
+static void convert_slice_worker(gpointer data, gpointer user_data) {
+	struct convert_slice *slice;
+	struct dev_context *devc;
+
+	(void) user_data;
+
+	slice = data;
+	devc = slice->devc;
+
+	convert_groups(devc, slice->dest, slice->src, slice->num_groups);
+
+	g_mutex_lock(&devc->convert_mutex);
+	if (--devc->convert_pending == 0)
+		g_cond_signal(&devc->convert_cond);
+	g_mutex_unlock(&devc->convert_mutex);
+}
+
+static void transpose_groups_parallel(struct dev_context *devc,
+										uint8_t *dest,
+										const uint8_t *src,
+										size_t num_groups) {
+	struct convert_slice *slice;
+	size_t slice_groups;
+	unsigned int i, num_slices;
+
+	num_slices = num_groups / CONVERT_SLICE_MIN_GROUPS;
+	if (num_slices > devc->convert_threads)
+		num_slices = devc->convert_threads;
+
+	if (!devc->convert_pool || num_slices < 2) {
+		convert_groups(devc, dest, src, num_groups);
+		return;
+	}
+
+	slice_groups = (num_groups + num_slices - 1) / num_slices;
+
+	devc->convert_pending = num_slices;
+	for (i = 0; i < num_slices; i++) {
+		slice = &devc->convert_slices[i];
+		slice->devc = devc;
+		slice->dest = dest;
+		slice->src = src;
+		slice->num_groups = MIN(slice_groups, num_groups);
+		dest += slice->num_groups * 16 * devc->unitsize;
+		src += slice->num_groups * devc->num_channels * 2;
+		num_groups -= slice->num_groups;
+		if (i > 0)
+			g_thread_pool_push(devc->convert_pool, slice, NULL);
+	}
+
+	convert_slice_worker(&devc->convert_slices[0], NULL);
+
+	g_mutex_lock(&devc->convert_mutex);
+	while (devc->convert_pending > 0)
+		g_cond_wait(&devc->convert_cond, &devc->convert_mutex);
+	g_mutex_unlock(&devc->convert_mutex);
+}
+
+/*
+ * Start the threads for devc->convert_threads slices, 0 means the number
+ * of CPUs. Less than 2 slices are converted by the calling thread only.
+ */
+SR_PRIV int kingst_laxxxx_convert_pool_start(struct dev_context *devc) {
+	GError *error = NULL;
+
+	devc->convert_pool = NULL;
+	if (!devc->convert_threads)
+		devc->convert_threads = g_get_num_processors();
+	if (devc->convert_threads > MAX_CONVERT_THREADS)
+		devc->convert_threads = MAX_CONVERT_THREADS;
+	if (devc->convert_threads < 2)
+		return SR_OK;
+
+	devc->convert_slices = g_try_new0(struct convert_slice, devc->convert_threads);
+	if (!devc->convert_slices) {
+		sr_err("Conversion slices malloc failed.");
+		return SR_ERR_MALLOC;
+	}
+
+	g_mutex_init(&devc->convert_mutex);
+	g_cond_init(&devc->convert_cond);
+
+	/* The calling thread converts a slice too. */
+	devc->convert_pool = g_thread_pool_new(convert_slice_worker, NULL,
+											devc->convert_threads - 1, TRUE, &error);
+	if (!devc->convert_pool) {
+		sr_err("Failed to start conversion threads: %s.", error->message);
+		g_error_free(error);
+		kingst_laxxxx_convert_pool_stop(devc);
+		return SR_ERR;
+	}
+
+	sr_info("Converting with %d threads.", devc->convert_threads);
+
+	return SR_OK;
+}
+
+SR_PRIV void kingst_laxxxx_convert_pool_stop(struct dev_context *devc) {
+	if (!devc->convert_slices)
+		return;
+
+	if (devc->convert_pool) {
+		g_thread_pool_free(devc->convert_pool, FALSE, TRUE);
+		devc->convert_pool = NULL;
+	}
+
+	g_mutex_clear(&devc->convert_mutex);
+	g_cond_clear(&devc->convert_cond);
+	g_free(devc->convert_slices);
+	devc->convert_slices = NULL;
+}
+
+SR_PRIV size_t kingst_laxxxx_convert_sample_data(struct dev_context *devc,
+												uint8_t *dest,
+												size_t destcnt,
+												const uint8_t *src,
+												size_t srccnt) {
+	uint16_t *channel_data;
+	int cur_channel, num_channels, i;
+	size_t ret = 0, num_groups, group_size;
+
+	srccnt /= 2;
+	group_size = 16 * devc->unitsize;
+
+	channel_data = devc->channel_data;
+	cur_channel = devc->cur_channel;
+	num_channels = devc->num_channels;
+
+	/* Complete the group carried over from the previous transfer. */
+	while (cur_channel && srccnt) {
+		convert_word(channel_data, src[0] | (src[1] << 8),
+				devc->channel_masks[cur_channel]);
+		src += 2;
+		srccnt--;
+
+		if (++cur_channel == num_channels) {
+			cur_channel = 0;
+			if (destcnt < group_size) {
+				sr_err("Conversion buffer too small! dstcnt %ld, srccnt %ld",
+						destcnt, srccnt);
+				devc->cur_channel = cur_channel;
+				return ret;
+			}
+			if (devc->unitsize == 2)
+				memcpy(dest, channel_data, 16 * 2);
+			else
+				for (i = 0; i < 16; i++)
+					dest[i] = channel_data[i];
+			memset(channel_data, 0, 16 * 2);
+			dest += group_size;
+			ret += 16;
+			destcnt -= group_size;
+		}
+	}
+
+	/* Full groups. */
+	num_groups = srccnt / num_channels;
+	if (num_groups > destcnt / group_size) {
+		sr_err("Conversion buffer too small! dstcnt %ld, srccnt %ld",
+				destcnt, srccnt);
+		num_groups = destcnt / group_size;
+		srccnt = num_groups * num_channels;
+	}
+	transpose_groups_parallel(devc, dest, src, num_groups);
+	src += num_groups * num_channels * 2;
+	srccnt -= num_groups * num_channels;
+	ret += num_groups * 16;
+
+	/* Keep an incomplete group for the next transfer. */
+	while (srccnt--) {
+		convert_word(channel_data, src[0] | (src[1] << 8),
+				devc->channel_masks[cur_channel++]);
+		src += 2;
+	}
+
+	devc->cur_channel = cur_channel;
+
+	return ret;
+}
+
+/*
+ * Process the sample data in blocks that fill convbuffer, so the output
+ * stays in the cache until it is sent. The words left from a skipped
+ * part of the stream are dropped first; with devc->bitplanes the data
+ * goes to 'bitplanes' as it is. Returns FALSE when a callback does.
+ */
+SR_PRIV gboolean kingst_laxxxx_walk_sample_data(const struct sr_dev_inst *sdi,
+												const uint8_t *buffer,
+												size_t length,
+												kingst_laxxxx_sample_fn block,
+												kingst_laxxxx_sample_fn bitplanes) {
+	struct dev_context *devc;
+	size_t block_length;
+
+	devc = sdi->priv;
+
+	if (devc->skip_words) {
+		block_length = MIN(devc->skip_words, length / 2);
+		devc->skip_words -= block_length;
+		buffer += block_length * 2;
+		length -= block_length * 2;
+	}
+
+	if (devc->bitplanes)
+		return bitplanes(sdi, buffer, length);
+
+	while (length) {
+		/* Words giving exactly the groups that fit into convbuffer. */
+		block_length = (devc->convbuffer_size / (16 * devc->unitsize))
+				* devc->num_channels - devc->cur_channel;
+		block_length = MIN(block_length * 2, length);
+
+		if (!block(sdi, buffer, block_length))
+			return FALSE;
+
+		buffer += block_length;
+		length -= block_length;
+	}
+
+	return TRUE;
+}
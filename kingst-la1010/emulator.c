@@ -0,0 +1,623 @@
+/*
+ * This file is part of the libsigrok project.
+ *
+ * Copyright (C) 2018 Alexandr Ugnenko <ugnenko@mail.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.	If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include "protocol.h"
+
+#ifdef KINGST_LAXXXX_EMULATOR
+
+/* Size of the bulk packets */
+#define EMULATOR_PACKET_SIZE 512
+/* Period of the session source handling the transfers */
+#define EMULATOR_POLL_MS 1
+
+/*
+ * Software device emulator.
+ *
+ * It is built when KINGST_LAXXXX_EMULATOR is defined, for example with
+ * CPPFLAGS=-DKINGST_LAXXXX_EMULATOR given to configure. When the
+ * KINGST_LAXXXX_EMULATOR environment variable is set, scan() adds an
+ * emulated LA1010A whose device handle is served by the operations below
+ * instead of by libusb: the control requests, the Spartan bitstream
+ * upload and the bulk IN transfers of the sampling stream. The stream
+ * is generated at the configured samplerate and channels mask, so the
+ * whole driver above the USB boundary can be run and load tested
+ * without hardware. The variable
+ * holds comma separated options ("1" for the defaults):
+ *   throughput=<N>   bytes per second of the stream, 0 -- as fast as
+ *                    possible (default: samplerate * channels / 8)
+ *   latency=<N>      microseconds from submit to completion of a transfer
+ *   short=<N>        every N-th transfer returns half of its length
+ *   error=<N>        every N-th transfer fails after half of its length
+ *   pattern=<name>   'counter' (sample N has value N, default) or 'random'
+ *
+ * Transfers may be submitted by the conversion pipeline thread, they
+ * are completed only from emulator_handle_events() in the thread
+ * handling the events.
+ */
+struct emulator_request {
+	struct libusb_transfer *transfer;
+	int64_t due;
+	int64_t deadline;
+	gboolean cancelled;
+};
+
+struct emulator {
+	GMutex mutex;
+	GQueue requests;
+
+	int64_t throughput;
+	uint64_t latency;
+	uint64_t short_every;
+	uint64_t error_every;
+	gboolean random;
+
+	uint32_t upload_expected;
+	uint32_t upload_received;
+	gboolean upload_done;
+	gboolean spartan_running;
+	/* Last command written to the Spartan with CMD_60 */
+	uint8_t spartan_command;
+
+	uint16_t channels_mask;
+	int num_channels;
+	int channels[16];
+	uint32_t samples_rate;
+	uint8_t smpl_status;
+
+	gboolean sampling;
+	int64_t start_time;
+	uint64_t stream_words;
+	uint64_t seed;
+	uint64_t num_completed;
+	uint64_t num_short;
+	uint64_t num_failed;
+};
+
+static struct emulator *emulator;
+
+static int emulator_parse_options(struct emulator *emu, const char *options) {
+	char **tokens, **kv;
+	char *end;
+	uint64_t value;
+	int i, ret;
+
+	ret = SR_OK;
+	tokens = g_strsplit(options, ",", 0);
+	for (i = 0; tokens[i] && ret == SR_OK; i++) {
+		kv = g_strsplit(tokens[i], "=", 2);
+		if (!kv[0] || !*kv[0] || !strcmp(kv[0], "1")) {
+			g_strfreev(kv);
+			continue;
+		}
+		if (!kv[1]) {
+			sr_err("Emulator option '%s' has no value.", kv[0]);
+			ret = SR_ERR_ARG;
+		} else if (!strcmp(kv[0], "pattern")) {
+			if (!strcmp(kv[1], "random"))
+				emu->random = TRUE;
+			else if (!strcmp(kv[1], "counter"))
+				emu->random = FALSE;
+			else
+				ret = SR_ERR_ARG;
+		} else {
+			value = g_ascii_strtoull(kv[1], &end, 0);
+			if (*end || end == kv[1])
+				ret = SR_ERR_ARG;
+			else if (!strcmp(kv[0], "throughput"))
+				emu->throughput = value;
+			else if (!strcmp(kv[0], "latency"))
+				emu->latency = value;
+			else if (!strcmp(kv[0], "short"))
+				emu->short_every = value;
+			else if (!strcmp(kv[0], "error"))
+				emu->error_every = value;
+			else
+				ret = SR_ERR_ARG;
+		}
+		if (ret != SR_OK)
+			sr_err("Wrong emulator option '%s'.", tokens[i]);
+		g_strfreev(kv);
+	}
+	g_strfreev(tokens);
+
+	return ret;
+}
+
+/*
+ * Returns the handle of the emulated device. It is created on the first
+ * call and lives until the process exits.
+ */
+struct libusb_device_handle* kingst_laxxxx_emulator_open(const char *options) {
+	struct emulator *emu;
+
+	if (emulator)
+		return (struct libusb_device_handle*) emulator;
+
+	emu = g_malloc0(sizeof(struct emulator));
+	emu->throughput = -1;
+	if (emulator_parse_options(emu, options) != SR_OK) {
+		g_free(emu);
+		return NULL;
+	}
+	g_mutex_init(&emu->mutex);
+	g_queue_init(&emu->requests);
+
+	sr_info("Emulating LA1010A: throughput %" PRIi64 ", latency %" PRIu64
+			" us, short every %" PRIu64 ", error every %" PRIu64 ", %s pattern.",
+			emu->throughput, emu->latency, emu->short_every,
+			emu->error_every, emu->random ? "random" : "counter");
+
+	emulator = emu;
+
+	return (struct libusb_device_handle*) emulator;
+}
+
+gboolean kingst_laxxxx_is_emulated(struct libusb_device_handle *hdl) {
+	return emulator && hdl == (struct libusb_device_handle*) emulator;
+}
+
+static void emulator_stop_sampling(struct emulator *emu) {
+	if (!emu->sampling)
+		return;
+
+	emu->sampling = FALSE;
+	sr_info("Emulator streamed %" PRIu64 " bytes in %" PRIu64
+			" transfers, %" PRIu64 " short, %" PRIu64 " failed.",
+			emu->stream_words * 2, emu->num_completed, emu->num_short,
+			emu->num_failed);
+}
+
+/*
+ * Answers a vendor control request like the LA1010A does. Returns the
+ * number of transferred bytes or a libusb error, unknown requests stall.
+ */
+static int LIBUSB_CALL emulator_control_transfer(libusb_device_handle *handle,
+													uint8_t request_type,
+													uint8_t request,
+													uint16_t value,
+													uint16_t index,
+													unsigned char *data,
+													uint16_t size,
+													unsigned int timeout) {
+	struct emulator *emu;
+	int i, ret;
+
+	(void) index;
+	(void) timeout;
+
+	emu = (struct emulator*) handle;
+	ret = size;
+
+	g_mutex_lock(&emu->mutex);
+
+	if (request_type & LIBUSB_ENDPOINT_IN) {
+		memset(data, 0, size);
+		switch (request) {
+		case CMD_STATUS:
+			if (value == CMD_STATUS_USB_STATUS && size == 4) {
+				WL16(data, 0x0001);
+				WL16(data + 2, 0xFFFE);
+			} else if (value == CMD_STATUS_FX_STATUS && size == 8) {
+				/* Device code of LA1010A variant 2 */
+				data[0] = 10;
+				data[1] = ~10;
+			} else {
+				ret = LIBUSB_ERROR_PIPE;
+			}
+			break;
+		case CMD_SPARTAN_UPLOAD:
+			data[0] = emu->upload_done ? 0 : 1;
+			break;
+		case CMD_CONTROL:
+			break;
+		case CMD_60:
+			/* Only a running bitstream answers, with its device ID. */
+			if (!emu->spartan_running)
+				ret = LIBUSB_ERROR_PIPE;
+			else if (emu->spartan_command == 0xCA)
+				memcpy(data, "KINGST-EMU00", MIN(size, SPARTAN_ID_SIZE));
+			break;
+		default:
+			ret = LIBUSB_ERROR_PIPE;
+			break;
+		}
+		g_mutex_unlock(&emu->mutex);
+		return ret;
+	}
+
+	switch (request) {
+	case CMD_SPARTAN_UPLOAD:
+		if (size != 4) {
+			ret = LIBUSB_ERROR_PIPE;
+			break;
+		}
+		emu->upload_expected = RL32(data);
+		emu->upload_received = 0;
+		emu->upload_done = FALSE;
+		emu->spartan_running = FALSE;
+		break;
+	case CMD_10:
+		emu->spartan_running = emu->upload_done;
+		break;
+	case CMD_RESET_BULK_STATE:
+		emulator_stop_sampling(emu);
+		emu->stream_words = 0;
+		break;
+	case CMD_SAMPLING_START:
+		if (!emu->spartan_running || emu->smpl_status != CMD_SMPL_STATUS_RUN
+				|| !emu->num_channels || !emu->samples_rate) {
+			ret = LIBUSB_ERROR_PIPE;
+			break;
+		}
+		emu->sampling = TRUE;
+		emu->start_time = g_get_monotonic_time();
+		emu->stream_words = 0;
+		emu->seed = 1;
+		emu->num_completed = emu->num_short = emu->num_failed = 0;
+		break;
+	case CMD_CONTROL:
+		if (value == CMD_CONTROL_CHAN_SELECT && size >= 4) {
+			emu->channels_mask = RL32(data);
+			emu->num_channels = 0;
+			for (i = 0; i < 16; i++) {
+				if (emu->channels_mask & (1 << i))
+					emu->channels[emu->num_channels++] = i;
+			}
+		} else if (value == CMD_CONTROL_SAMPLE_RATE
+				&& size == sizeof(struct samples_config)) {
+			emu->samples_rate = RL32(data + 12);
+		} else if (value == CMD_CONTROL_SMPL && size == 1) {
+			emu->smpl_status = data[0];
+			if (emu->smpl_status != CMD_SMPL_STATUS_RUN)
+				emulator_stop_sampling(emu);
+		}
+		break;
+	case CMD_60:
+		if (size >= 3)
+			emu->spartan_command = data[2];
+		break;
+	default:
+		ret = LIBUSB_ERROR_PIPE;
+		break;
+	}
+
+	g_mutex_unlock(&emu->mutex);
+
+	return ret;
+}
+
+/*
+ * Receives the Spartan bitstream, the upload is done with a zero length
+ * packet after the announced number of bytes.
+ */
+static int emulator_bulk_out(libusb_device_handle *handle,
+								const uint8_t *data,
+								int length) {
+	struct emulator *emu;
+
+	(void) data;
+
+	emu = (struct emulator*) handle;
+
+	g_mutex_lock(&emu->mutex);
+	if (length == 0)
+		emu->upload_done = emu->upload_received == emu->upload_expected;
+	else
+		emu->upload_received += length;
+	g_mutex_unlock(&emu->mutex);
+
+	return length;
+}
+
+/*
+ * Queues the bulk IN transfers of the stream, the bulk OUT ones of the
+ * bitstream upload and the control transfers.
+ */
+static int LIBUSB_CALL emulator_submit(struct libusb_transfer *transfer) {
+	struct emulator *emu;
+	struct emulator_request *req;
+
+	emu = (struct emulator*) transfer->dev_handle;
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_BULK) {
+		if (transfer->endpoint != USB_SAMPLING_DATA_EP
+				&& transfer->endpoint != USB_UPLOAD_DATA_EP)
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+	} else if (transfer->type != LIBUSB_TRANSFER_TYPE_CONTROL
+			|| transfer->length < LIBUSB_CONTROL_SETUP_SIZE) {
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	req = g_malloc0(sizeof(struct emulator_request));
+	req->transfer = transfer;
+	req->due = g_get_monotonic_time() + emu->latency;
+	if (transfer->timeout)
+		req->deadline = req->due + transfer->timeout * (int64_t) 1000;
+
+	g_mutex_lock(&emu->mutex);
+	g_queue_push_tail(&emu->requests, req);
+	g_mutex_unlock(&emu->mutex);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int LIBUSB_CALL emulator_cancel(struct libusb_transfer *transfer) {
+	struct emulator *emu;
+	struct emulator_request *req;
+	GList *l;
+	int ret;
+
+	emu = (struct emulator*) transfer->dev_handle;
+	ret = LIBUSB_ERROR_NOT_FOUND;
+
+	g_mutex_lock(&emu->mutex);
+	for (l = emu->requests.head; l; l = l->next) {
+		req = l->data;
+		if (req->transfer == transfer && !req->cancelled) {
+			req->cancelled = TRUE;
+			ret = LIBUSB_SUCCESS;
+			break;
+		}
+	}
+	g_mutex_unlock(&emu->mutex);
+
+	return ret;
+}
+
+/*
+ * Number of stream words the device has sampled by 'now' but not sent yet.
+ */
+static uint64_t emulator_available_words(struct emulator *emu, int64_t now) {
+	uint64_t bytes_per_sec, samplerate, words;
+
+	if (!emu->sampling)
+		return 0;
+
+	if (emu->throughput == 0)
+		return G_MAXUINT64;
+
+	if (emu->throughput > 0) {
+		bytes_per_sec = emu->throughput;
+	} else {
+		samplerate = (uint64_t) SAMPLING_BASE_FREQUENCY * 0x100
+				/ emu->samples_rate;
+		bytes_per_sec = samplerate * emu->num_channels / 8;
+	}
+
+	words = (uint64_t) (now - emu->start_time) * bytes_per_sec / 2000000;
+
+	return words > emu->stream_words ? words - emu->stream_words : 0;
+}
+
+static void emulator_fill(struct emulator *emu, uint8_t *buffer, size_t num_words) {
+	static const uint16_t low_bits[4] = { 0xAAAA, 0xCCCC, 0xF0F0, 0xFF00 };
+	uint64_t group;
+	uint16_t word;
+	int channel;
+	size_t i;
+
+	for (i = 0; i < num_words; i++, emu->stream_words++) {
+		if (emu->random) {
+			emu->seed = emu->seed * 6364136223846793005ULL
+					+ 1442695040888963407ULL;
+			word = emu->seed >> 48;
+		} else {
+			/* The word holds samples group * 16 .. group * 16 + 15. */
+			group = emu->stream_words / emu->num_channels;
+			channel = emu->channels[emu->stream_words % emu->num_channels];
+			if (channel < 4)
+				word = low_bits[channel];
+			else
+				word = ((group << 4) >> channel) & 1 ? 0xFFFF : 0;
+		}
+		WL16(buffer + i * 2, word);
+	}
+}
+
+/*
+ * Fills the bulk IN transfer with the samples streamed by 'now'. Returns
+ * FALSE when it isn't complete yet. Called with the mutex locked.
+ */
+static gboolean emulator_stream(struct emulator *emu,
+								struct emulator_request *req,
+								int64_t now) {
+	struct libusb_transfer *transfer;
+	uint64_t available, num_words;
+
+	transfer = req->transfer;
+
+	num_words = transfer->length / 2;
+	if (emu->short_every
+			&& (emu->num_completed + 1) % emu->short_every == 0)
+		num_words = MAX(num_words / 2, 1);
+
+	available = emulator_available_words(emu, now);
+	if (available >= num_words) {
+		transfer->status = LIBUSB_TRANSFER_COMPLETED;
+	} else if (req->deadline && now >= req->deadline) {
+		/* Like libusb, return what was received until the timeout. */
+		transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+		num_words = available;
+	} else {
+		return FALSE;
+	}
+
+	emu->num_completed++;
+	if (emu->error_every && emu->num_completed % emu->error_every == 0) {
+		/* The words received before the error are delivered. */
+		transfer->status = LIBUSB_TRANSFER_ERROR;
+		num_words /= 2;
+		emu->num_failed++;
+	} else if (num_words < (uint64_t) transfer->length / 2) {
+		emu->num_short++;
+	}
+	emulator_fill(emu, transfer->buffer, num_words);
+	transfer->actual_length = num_words * 2;
+
+	return TRUE;
+}
+
+/*
+ * Completes a control or bulk OUT transfer, the requests are handled at
+ * once.
+ */
+static void emulator_complete_out(struct libusb_transfer *transfer) {
+	uint8_t *setup;
+	int ret;
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		setup = transfer->buffer;
+		ret = emulator_control_transfer(transfer->dev_handle, setup[0],
+				setup[1], RL16(setup + 2), RL16(setup + 4),
+				setup + LIBUSB_CONTROL_SETUP_SIZE, RL16(setup + 6), 0);
+	} else {
+		ret = emulator_bulk_out(transfer->dev_handle, transfer->buffer,
+				transfer->length);
+	}
+
+	if (ret < 0) {
+		transfer->status = ret == LIBUSB_ERROR_PIPE ? LIBUSB_TRANSFER_STALL
+				: LIBUSB_TRANSFER_ERROR;
+		transfer->actual_length = 0;
+	} else {
+		transfer->status = LIBUSB_TRANSFER_COMPLETED;
+		transfer->actual_length = ret;
+	}
+}
+
+/*
+ * Completes the due transfers in submit order. Transfers resubmitted by
+ * the callbacks are left for the next call. Returns the number of
+ * completed transfers.
+ */
+static unsigned int emulator_complete(struct emulator *emu) {
+	struct emulator_request *req;
+	struct libusb_transfer *transfer;
+	unsigned int i, num_requests;
+	gboolean out;
+	int64_t now;
+
+	now = g_get_monotonic_time();
+
+	g_mutex_lock(&emu->mutex);
+	num_requests = emu->requests.length;
+	g_mutex_unlock(&emu->mutex);
+
+	for (i = 0; i < num_requests; i++) {
+		g_mutex_lock(&emu->mutex);
+		if (!(req = g_queue_peek_head(&emu->requests))) {
+			g_mutex_unlock(&emu->mutex);
+			break;
+		}
+		transfer = req->transfer;
+		transfer->actual_length = 0;
+
+		out = FALSE;
+		if (req->cancelled) {
+			transfer->status = LIBUSB_TRANSFER_CANCELLED;
+		} else if (now < req->due) {
+			g_mutex_unlock(&emu->mutex);
+			break;
+		} else if (transfer->endpoint != USB_SAMPLING_DATA_EP) {
+			out = TRUE;
+		} else if (!emulator_stream(emu, req, now)) {
+			g_mutex_unlock(&emu->mutex);
+			break;
+		}
+
+		g_queue_pop_head(&emu->requests);
+		g_mutex_unlock(&emu->mutex);
+		g_free(req);
+
+		if (out)
+			emulator_complete_out(transfer);
+		transfer->callback(transfer);
+	}
+
+	return i;
+}
+
+/*
+ * Like libusb, waits up to 'tv' for the transfers, at most
+ * EMULATOR_POLL_MS when none is due.
+ */
+static int LIBUSB_CALL emulator_handle_events(libusb_context *ctx,
+												struct timeval *tv,
+												int *completed) {
+	int64_t timeout;
+
+	(void) ctx;
+
+	if (!emulator || emulator_complete(emulator) || (completed && *completed))
+		return LIBUSB_SUCCESS;
+
+	timeout = tv->tv_sec * (int64_t) G_USEC_PER_SEC + tv->tv_usec;
+	if (timeout > 0)
+		g_usleep(MIN(timeout, EMULATOR_POLL_MS * 1000));
+
+	return LIBUSB_SUCCESS;
+}
+
+static int emulator_get_config(libusb_device_handle *handle,
+								int *num_interfaces,
+								int *num_endpoints) {
+	(void) handle;
+
+	*num_interfaces = 1;
+	*num_endpoints = 2;
+
+	return LIBUSB_SUCCESS;
+}
+
+static int emulator_get_max_packet_size(libusb_device_handle *handle,
+										unsigned char endpoint) {
+	(void) handle;
+	(void) endpoint;
+
+	return EMULATOR_PACKET_SIZE;
+}
+
+static int LIBUSB_CALL emulator_interface(libusb_device_handle *handle,
+											int interface_number) {
+	(void) handle;
+	(void) interface_number;
+
+	return LIBUSB_SUCCESS;
+}
+
+/* The handle lives until the process exits. */
+static void LIBUSB_CALL emulator_close(libusb_device_handle *handle) {
+	(void) handle;
+}
+
+const struct kingst_laxxxx_usb_ops kingst_laxxxx_emulator_ops = {
+	.poll_ms = EMULATOR_POLL_MS,
+	.get_config = emulator_get_config,
+	.get_max_packet_size = emulator_get_max_packet_size,
+	.claim_interface = emulator_interface,
+	.release_interface = emulator_interface,
+	.close = emulator_close,
+	.control_transfer = emulator_control_transfer,
+	.submit_transfer = emulator_submit,
+	.cancel_transfer = emulator_cancel,
+	.handle_events = emulator_handle_events,
+};
+
+#endif
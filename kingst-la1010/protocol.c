@@ -17,14 +17,58 @@
  * along with this program.	If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* sched_setaffinity() */
+#endif
 #include <config.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include "protocol.h"
 
+#ifdef G_OS_UNIX
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <pthread.h>
+#endif
+
 #define USB_TIMEOUT 1000
 
+/* Largest FX2 RAM write of the Intel-HEX loader, like ezusb_upload_firmware() */
+#define FX2_UPLOAD_CHUNK_SIZE 4096
+
+/* Spartan upload: size and number of the bulk OUT transfers in flight */
+#define SPARTAN_UPLOAD_CHUNK_SIZE (16 * 1024)
+#define SPARTAN_UPLOAD_TRANSFERS 4
+/* Highest USB 2.0 bulk throughput: 13 packets of 512 bytes per microframe */
+#define USB2_BULK_MAX_BYTES_PER_SEC (13 * 512 * 8000)
+
+/* Autotuning: completions measured before each retuning */
+#define AUTOTUNE_COMPLETIONS 16
+/* Autotuning: bounds of the number of transfers */
+#define AUTOTUNE_MIN_TRANSFERS 4
+#define AUTOTUNE_MAX_TRANSFERS 64
+/* Autotuning: shortest transfer, and its minimal ratio to the callback time */
+#define AUTOTUNE_MIN_PERIOD_US 2000
+#define AUTOTUNE_BUSY_RATIO 4
+
+/* Default longest wait of the samples for a merged packet */
+#define PACKET_AGE_DEFAULT_MS 100
+
+/* Low latency: most transfers, and period of the latency reports */
+#define LATENCY_MAX_TRANSFERS 64
+#define LATENCY_REPORT_US 1000000
+
+/* USB thread: period of the session source delivering its data */
+#define USB_THREAD_POLL_MS 2
+/* USB thread: longest wait for the USB events */
+#define USB_THREAD_EVENTS_TIMEOUT_MS 100
+
+/* Real time replay: period of the session source checking for due transfers */
+#define REPLAY_POLL_MS 1
+
 
 const char * cypres_fw_pattern_hex = "kingst/fw%04X.hex";
 const char * cypres_fw_pattern_fw = "kingst/fw%04X.fw";
@@ -199,31 +243,91 @@ struct kingst_laxxxx_desc* get_device_description(uint8_t data[8]);
 
 static int read_hex_digit(unsigned char *firmware, size_t fw_size, size_t *offset);
 static int read_hex_byte(unsigned char *firmware, size_t fw_size, size_t *offset);
-static int read_hex_line(unsigned char *firmware,
-							size_t fw_size,
-							size_t *offset,
-							uint16_t *addr,
-							unsigned char *buffer);
+struct firmware_image;
+static struct firmware_image* firmware_cache_get(struct sr_context *ctx,
+													const char *name,
+													size_t max_size,
+													gboolean hex);
+static void firmware_image_unref(gpointer data);
+static int upload_hex_firmware(struct libusb_device_handle *hdl,
+								const struct firmware_image *image);
 static int upload_cypress_firmware(struct sr_context *ctx,
 									struct libusb_device_handle *hdl,
 									const char *fw_file_name);
 
 static void finish_acquisition(const struct sr_dev_inst *sdi);
+static void abort_start(const struct sr_dev_inst *sdi);
 static void free_transfer(struct libusb_transfer *transfer);
 static void resubmit_transfer(struct libusb_transfer *transfer);
-static size_t convert_sample_data(struct dev_context *devc,
-									uint8_t *dest,
-									size_t destcnt,
-									const uint8_t *src,
-									size_t srccnt);
+static gboolean process_sample_data(const struct sr_dev_inst *sdi,
+									const uint8_t *buffer,
+									size_t length);
+static void skip_sample_data(const struct sr_dev_inst *sdi, uint64_t length);
+static void packet_start(struct dev_context *devc);
+static void packet_stop(const struct sr_dev_inst *sdi);
+static void flush_logic(const struct sr_dev_inst *sdi);
+static void packet_poll(const struct sr_dev_inst *sdi);
+static void send_frame(const struct sr_dev_inst *sdi, gboolean begin);
+static void send_segment(const struct sr_dev_inst *sdi, int64_t dead_time);
+static gboolean process_bitplanes(const struct sr_dev_inst *sdi,
+									const uint8_t *buffer,
+									size_t length);
+static gboolean process_sample_block(const struct sr_dev_inst *sdi,
+									const uint8_t *buffer,
+									size_t length);
+static int pipeline_start(const struct sr_dev_inst *sdi);
+static void pipeline_stop(const struct sr_dev_inst *sdi);
+static void pipeline_poll(const struct sr_dev_inst *sdi);
+static void pipeline_drain(const struct sr_dev_inst *sdi);
+static void pipeline_push(const struct sr_dev_inst *sdi,
+							struct libusb_transfer *transfer,
+							int64_t completed);
 static int command_start_acquisition(const struct sr_dev_inst *sdi);
+static int command_start_sampling(const struct sr_dev_inst *sdi);
 static int start_transfers(const struct sr_dev_inst *sdi);
-
+static struct sr_trigger *get_trigger(const struct sr_dev_inst *sdi);
+static int setup_soft_trigger(const struct sr_dev_inst *sdi);
+static int check_transfer(struct dev_context *devc, int status, int length);
+
+static int record_start(const struct sr_dev_inst *sdi);
+static void record_transfer(struct dev_context *devc,
+							const struct libusb_transfer *transfer);
+static void record_stop(struct dev_context *devc);
+static int replay_open(const struct sr_dev_inst *sdi);
+static int replay_start(const struct sr_dev_inst *sdi);
+static void replay_close(struct dev_context *devc);
+static int replay_receive_data(int fd, int revents, void *cb_data);
+
+static uint64_t get_env_uint(const char *name, uint64_t def);
+static void session_send(const struct sr_dev_inst *sdi,
+							const struct sr_datafeed_packet *packet);
 static unsigned int to_bytes_per_ms(unsigned int samplerate,
 									uint8_t num_channels);
-static size_t get_buffer_size(struct dev_context *devc);
 static unsigned int get_number_of_transfers(struct dev_context *devc);
 static unsigned int get_timeout(struct dev_context *devc);
+static unsigned int get_transfers_timeout(struct dev_context *devc,
+											size_t size,
+											unsigned int num_transfers);
+static void pool_reserve(const struct sr_dev_inst *sdi, size_t size);
+static uint8_t* pool_get_buffer(const struct sr_dev_inst *sdi);
+static void pool_put_buffer(struct dev_context *devc, uint8_t *buffer);
+static struct libusb_transfer* pool_get_transfer(const struct sr_dev_inst *sdi,
+												size_t size,
+												unsigned int timeout);
+static void pool_put_transfer(struct dev_context *devc,
+								struct libusb_transfer *transfer);
+
+static int usb_thread_start(const struct sr_dev_inst *sdi);
+static void usb_thread_finish(const struct sr_dev_inst *sdi);
+static void latency_start(struct dev_context *devc);
+static void latency_update(const struct sr_dev_inst *sdi,
+							int64_t completed,
+							size_t length);
+static void latency_stop(const struct sr_dev_inst *sdi);
+static void autotune_start(struct dev_context *devc);
+static void autotune_update(const struct sr_dev_inst *sdi, int64_t completed);
+static gboolean autotune_transfer(const struct sr_dev_inst *sdi,
+									struct libusb_transfer *transfer);
 
 static void LIBUSB_CALL
 abort_acquisition_request_cb(struct libusb_transfer *transfer);
@@ -244,10 +348,19 @@ static int control_out(libusb_device_handle *handle,
 						uint8_t *data,
 						uint16_t size);
 
-static int upload_bindata_sync(libusb_device_handle *handle,
-								uint8_t *data,
-								int size,
-								int trans_size);
+static int upload_bindata(libusb_context *ctx,
+							libusb_device_handle *handle,
+							uint8_t *data,
+							int size,
+							int packet_size);
+struct bindata_upload;
+static gboolean bindata_upload_next(struct bindata_upload *upload,
+									libusb_device_handle *handle,
+									struct libusb_transfer *transfer);
+static int get_max_packet_size(libusb_device_handle *handle,
+								unsigned char endpoint);
+static int submit_transfer(struct libusb_transfer *transfer);
+static int cancel_transfer(struct libusb_transfer *transfer);
 
 
 struct kingst_laxxxx_desc* get_device_description(uint8_t data[8]) {
@@ -337,11 +450,11 @@ int read_hex_byte(unsigned char *firmware, size_t fw_size, size_t *offset) {
 	return data;
 }
 
-int read_hex_line(unsigned char *firmware,
-					size_t fw_size,
-					size_t *offset,
-					uint16_t *addr,
-					unsigned char *buffer) {
+SR_PRIV int kingst_laxxxx_read_hex_line(unsigned char *firmware,
+										size_t fw_size,
+										size_t *offset,
+										uint16_t *addr,
+										unsigned char *buffer) {
 	int data;
 	uint8_t size, i, checksum;
 
@@ -438,22 +551,20 @@ int read_hex_line(unsigned char *firmware,
  * Returns pointer to 'struct kingst_laxxxx_desc' in 'device_desc' if device is supported.
  */
 int kingst_laxxxx_has_fx_firmware(struct libusb_device_handle *hdl, struct kingst_laxxxx_desc ** device_desc) {
-	int err;
-	struct libusb_device * dev;
- 	struct libusb_config_descriptor * config;
+	int err, num_interfaces, num_endpoints;
 	union fx_status fx_status;
 	uint16_t dev_batch;
 
-	dev = libusb_get_device(hdl);
-	err = libusb_get_active_config_descriptor(dev, &config);
+	err = kingst_laxxxx_usb_ops(hdl)->get_config(hdl, &num_interfaces,
+			&num_endpoints);
 	if (err) {
 		sr_err(
 				"kingst_laxxxx_has_fx_firmware(): get active usb config descriptor failed. libusb err: %s",
 				libusb_error_name(err));
 		return err;
 	}
-	if (config->bNumInterfaces == 1) {
-		if (config->interface->altsetting->bNumEndpoints == 2) {
+	if (num_interfaces == 1) {
+		if (num_endpoints == 2) {
 
 			err = control_in(hdl,
 								CMD_STATUS,
@@ -502,13 +613,213 @@ int kingst_laxxxx_has_fx_firmware(struct libusb_device_handle *hdl, struct kings
 	return SR_ERR;
 }
 
+/*
+ * Contiguous part of an Intel-HEX image: 'length' bytes for the FX2 RAM
+ * at 'addr', kept at 'start' in the image data.
+ */
+struct hex_range {
+	uint32_t addr;
+	size_t length;
+	size_t start;
+};
+
+/*
+ * Decoded firmware image. The bitstream is kept as read, the Intel-HEX
+ * file as its data and the contiguous ranges of it.
+ */
+struct firmware_image {
+	char *name;
+	gchar *hash;
+	uint8_t *data;
+	size_t size;
+	/* Ranges of the Intel-HEX image, NULL for a binary one */
+	GArray *ranges;
+	unsigned int num_records;
+	int refcount;
+};
+
+/*
+ * Process-wide firmware cache.
+ *
+ * The decoded Intel-HEX images by resource name. The resource is still
+ * read on every load, but when its SHA-256 matches the cached image the
+ * decoding is skipped and the image is shared: opening many devices costs
+ * one read and one hash each. An image replaced in the cache stays valid
+ * until its last user releases it. Binary images need no decoding, they
+ * aren't cached and only their hash is kept by the caller.
+ */
+static GMutex firmware_cache_mutex;
+static GHashTable *firmware_cache;
+
+static void firmware_image_unref(gpointer data) {
+	struct firmware_image *image;
+
+	image = data;
+	if (!image || !g_atomic_int_dec_and_test(&image->refcount))
+		return;
+
+	if (image->ranges)
+		g_array_free(image->ranges, TRUE);
+	g_free(image->data);
+	g_free(image->hash);
+	g_free(image->name);
+	g_free(image);
+}
+
+/*
+ * Releases the cached images, the ones still used stay valid until they
+ * are released by their users.
+ */
+SR_PRIV void kingst_laxxxx_firmware_cache_free(void) {
+	g_mutex_lock(&firmware_cache_mutex);
+	if (firmware_cache)
+		g_hash_table_destroy(firmware_cache);
+	firmware_cache = NULL;
+	g_mutex_unlock(&firmware_cache_mutex);
+}
+
+/*
+ * Parses the whole Intel-HEX file and merges the records which continue
+ * the previous one.
+ */
+static int decode_hex_firmware(struct firmware_image *image,
+								unsigned char *firmware,
+								size_t fw_size) {
+	GByteArray *data;
+	struct hex_range *range, next;
+	size_t offset;
+	uint16_t addr;
+	unsigned char buffer[16];
+	int res;
+
+	data = g_byte_array_new();
+	image->ranges = g_array_new(FALSE, FALSE, sizeof(struct hex_range));
+	image->num_records = 0;
+
+	offset = 0;
+	while ((res = kingst_laxxxx_read_hex_line(firmware, fw_size, &offset, &addr, buffer)) > 0) {
+		range = image->ranges->len ? &g_array_index(image->ranges,
+				struct hex_range, image->ranges->len - 1) : NULL;
+		if (!range || range->addr + range->length != addr) {
+			next.addr = addr;
+			next.length = 0;
+			next.start = data->len;
+			g_array_append_val(image->ranges, next);
+			range = &g_array_index(image->ranges, struct hex_range,
+					image->ranges->len - 1);
+		}
+		g_byte_array_append(data, buffer, res);
+		range->length += res;
+		image->num_records++;
+	}
+
+	image->size = data->len;
+	image->data = g_byte_array_free(data, FALSE);
+
+	return res < 0 ? res : SR_OK;
+}
+
+/*
+ * Returns a reference to the decoded image of the firmware resource, or
+ * NULL when it can't be read or decoded.
+ */
+static struct firmware_image* firmware_cache_get(struct sr_context *ctx,
+													const char *name,
+													size_t max_size,
+													gboolean hex) {
+	struct firmware_image *image, *cached;
+	unsigned char *firmware;
+	size_t fw_size;
+	gchar *hash;
+
+	firmware = sr_resource_load(ctx, SR_RESOURCE_FIRMWARE, name, &fw_size,
+			max_size);
+	if (!firmware)
+		return NULL;
+
+	hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256, firmware, fw_size);
+
+	image = g_malloc0(sizeof(struct firmware_image));
+	image->name = g_strdup(name);
+	image->hash = hash;
+	image->refcount = 1;
+
+	if (!hex) {
+		image->data = firmware;
+		image->size = fw_size;
+		return image;
+	}
+
+	g_mutex_lock(&firmware_cache_mutex);
+	cached = firmware_cache ? g_hash_table_lookup(firmware_cache, name) : NULL;
+	if (cached && !strcmp(cached->hash, hash)) {
+		g_atomic_int_inc(&cached->refcount);
+		g_mutex_unlock(&firmware_cache_mutex);
+		sr_dbg("Firmware '%s' is unchanged, using the cached image.", name);
+		g_free(firmware);
+		firmware_image_unref(image);
+		return cached;
+	}
+	g_mutex_unlock(&firmware_cache_mutex);
+
+	if (decode_hex_firmware(image, firmware, fw_size) != SR_OK) {
+		g_free(firmware);
+		firmware_image_unref(image);
+		return NULL;
+	}
+	g_free(firmware);
+
+	/* One reference for the cache, one for the caller. */
+	g_atomic_int_inc(&image->refcount);
+	g_mutex_lock(&firmware_cache_mutex);
+	if (!firmware_cache)
+		firmware_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+				firmware_image_unref);
+	g_hash_table_replace(firmware_cache, image->name, image);
+	g_mutex_unlock(&firmware_cache_mutex);
+
+	return image;
+}
+
+/*
+ * Writes the ranges of the Intel-HEX image in chunks of up to
+ * FX2_UPLOAD_CHUNK_SIZE bytes: a few large 0xA0 requests instead of one
+ * request per 16-byte line.
+ */
+int upload_hex_firmware(struct libusb_device_handle *hdl,
+						const struct firmware_image *image) {
+	struct hex_range *range;
+	size_t pos, chunk;
+	unsigned int i, num_requests;
+	int res;
+
+	res = SR_OK;
+	num_requests = 0;
+	for (i = 0; i < image->ranges->len && res >= 0; i++) {
+		range = &g_array_index(image->ranges, struct hex_range, i);
+		for (pos = 0; pos < range->length; pos += chunk) {
+			chunk = MIN(range->length - pos, FX2_UPLOAD_CHUNK_SIZE);
+			res = control_out(hdl, 0xA0, range->addr + pos,
+					image->data + range->start + pos, chunk);
+			if (res < 0)
+				break;
+			num_requests++;
+		}
+	}
+
+	if (res >= 0)
+		sr_dbg("Uploaded %zu bytes of %u Intel-HEX records in %u requests.",
+				image->size, image->num_records, num_requests);
+
+	return res < 0 ? res : SR_OK;
+}
+
 int upload_cypress_firmware(struct sr_context *ctx,
 							struct libusb_device_handle *hdl,
 							const char *fw_file_name) {
-	size_t s, offset, fw_size;
-	uint16_t addr;
+	struct firmware_image *image;
+	size_t s;
 	int res;
-	unsigned char *firmware, buffer[16];
 
 	sr_dbg("Uploading FX2 firmware from '%s'...", fw_file_name);
 
@@ -531,28 +842,16 @@ int upload_cypress_firmware(struct sr_context *ctx,
 			}
 		} else {
 			// Intel-HEX
-			firmware = sr_resource_load(ctx,
-										SR_RESOURCE_FIRMWARE,
-										fw_file_name,
-										&fw_size,
-										1 << 16);
+			image = firmware_cache_get(ctx, fw_file_name, 1 << 16, TRUE);
 
-			if (!firmware) {
+			if (!image) {
 				sr_err("upload_cypress_firmware(): Read Intel-HEX file failed");
 				return SR_ERR;
 			}
 
-			offset = 0;
-			res = read_hex_line(firmware, fw_size, &offset, &addr, buffer);
-			while (res > 0) {
-				res = control_out(hdl, 0xA0, addr, buffer, res);
-				if (res < 0) {
-					break;
-				}
-				res = read_hex_line(firmware, fw_size, &offset, &addr, buffer);
-			}
+			res = upload_hex_firmware(hdl, image);
 
-			g_free(firmware);
+			firmware_image_unref(image);
 
 			if (res < 0) {
 				sr_err("upload_cypress_firmware(): Upload Intel-HEX FW failed");
@@ -590,39 +889,50 @@ int kingst_laxxxx_upload_cypress_firmware(struct sr_context *ctx,
 }
 
 /*
- * Upload spartan bitstream.
+ * Reads the device ID from the Spartan, only a running bitstream answers.
  */
-int kingst_laxxxx_upload_spartan_firmware(const struct sr_dev_inst *sdi) {
-	struct drv_context *drvc;
-	struct dev_context *devc;
-	struct sr_usb_dev_inst *usb;
-	struct libusb_device *usbdev;
+static int spartan_device_id(struct libusb_device_handle *hdl, uint8_t *id) {
+	uint8_t request[3];
+	int err;
+
+	request[0] = 0xA3;
+	request[1] = 0x01;
+	request[2] = 0xCA;
+	err = control_out(hdl, CMD_60, 0, request, sizeof(request));
+	if (err)
+		return err;
+
+	return control_in(hdl, CMD_60, 0, id, SPARTAN_ID_SIZE);
+}
+
+/*
+ * Check if the Spartan is configured: the FX reports the state of the
+ * last upload, 0 -- the bitstream was loaded, and the Spartan itself
+ * still answers with the device ID read after the upload.
+ */
+static gboolean spartan_configured(struct libusb_device_handle *hdl,
+									const uint8_t *device_id) {
 	union spartan_status spartan_status;
-	uint8_t *bindata, verify_data[32];
-	uint32_t binsize;
-	int err, i;
-	char fw_file_name[128];
+	uint8_t id[SPARTAN_ID_SIZE];
 
-	usb = sdi->conn;
-	drvc = sdi->driver->context;
-	devc = sdi->priv;
+	if (control_in(hdl, CMD_SPARTAN_UPLOAD, 0, spartan_status.bytes, 1)
+			|| spartan_status.bytes[0] != 0)
+		return FALSE;
 
-	if (devc->profile.description->device_variant < 0) {
-		snprintf(fw_file_name, 128, spartan_fw_pattern_hex, devc->profile.description->model);
-	} else {
-		snprintf(fw_file_name, 128, spartan_fw_pattern_hexd, devc->profile.description->model, devc->profile.description->device_variant);
-	}
+	if (spartan_device_id(hdl, id))
+		return FALSE;
 
-	sr_dbg("Uploading Spartan firmware from '%s'...", fw_file_name);
+	return !memcmp(id, device_id, SPARTAN_ID_SIZE);
+}
 
-	bindata = sr_resource_load(drvc->sr_ctx,
-								SR_RESOURCE_FIRMWARE,
-								fw_file_name,
-								(size_t*) &binsize,
-								0x020000);
-	if (!bindata) {
-		return SR_ERR_MALLOC;
-	}
+static int upload_spartan_bitstream(libusb_context *ctx,
+									struct sr_usb_dev_inst *usb,
+									uint8_t *bindata,
+									uint32_t binsize,
+									uint8_t *device_id) {
+	union spartan_status spartan_status;
+	uint8_t verify_data[32];
+	int err, i;
 
 	err = control_out(usb->devhdl,
 						CMD_SPARTAN_UPLOAD,
@@ -636,14 +946,11 @@ int kingst_laxxxx_upload_spartan_firmware(const struct sr_dev_inst *sdi) {
 		return err;
 	}
 
-	usbdev = libusb_get_device(usb->devhdl);
-	if (usbdev) {
-		i = libusb_get_max_packet_size(usbdev, USB_UPLOAD_DATA_EP);
-
+	i = get_max_packet_size(usb->devhdl, USB_UPLOAD_DATA_EP);
+	if (i > 0) {
 		sr_dbg("Upload Spartan firmware using packet size %d", i);
 
-		err = upload_bindata_sync(usb->devhdl, bindata, binsize, i);
-		g_free(bindata);
+		err = upload_bindata(ctx, usb->devhdl, bindata, binsize, i);
 		if (err) {
 			sr_err(
 					"kingst_laxxxx_upload_spartan_firmware(): upload Spartan firmware failed. libusb err: %s",
@@ -728,28 +1035,10 @@ int kingst_laxxxx_upload_spartan_firmware(const struct sr_dev_inst *sdi) {
 		/// GetVerifyData end
 
 		/// GetDeviceID
-		verify_data[0] = 0xA3;
-		verify_data[1] = 0x01;
-		verify_data[2] = 0xCA;
-		err = control_out(usb->devhdl,
-							CMD_60,
-							0,
-							verify_data,
-							3);
-		if (err) {
-			sr_err(
-					"kingst_laxxxx_upload_spartan_firmware(): GetVerifyData out failed. libusb err: %s",
-					libusb_error_name(err));
-			return err;
-		}
-		err = control_in(usb->devhdl,
-							CMD_60,
-							0,
-							verify_data,
-							12);
+		err = spartan_device_id(usb->devhdl, device_id);
 		if (err) {
 			sr_err(
-					"kingst_laxxxx_upload_spartan_firmware(): GetVerifyData in failed. libusb err: %s",
+					"kingst_laxxxx_upload_spartan_firmware(): GetDeviceID failed. libusb err: %s",
 					libusb_error_name(err));
 			return err;
 		}
@@ -757,13 +1046,79 @@ int kingst_laxxxx_upload_spartan_firmware(const struct sr_dev_inst *sdi) {
 
 	} else {
 		sr_err(
-				"Upload Spartan failed. Can't get usb device struct by device handle");
+				"Upload Spartan failed. Can't get packet size of the upload endpoint");
 		return SR_ERR;
 	}
 
 	return err;
 }
 
+/*
+ * Upload spartan bitstream.
+ *
+ * The hash of the last bitstream uploaded to the device is kept. When
+ * the device is opened again with the same bitstream and the Spartan
+ * still answers with the device ID read after that upload, the upload
+ * and its delays are skipped.
+ */
+int kingst_laxxxx_upload_spartan_firmware(const struct sr_dev_inst *sdi) {
+	struct drv_context *drvc;
+	struct dev_context *devc;
+	struct sr_usb_dev_inst *usb;
+	struct firmware_image *image;
+	uint8_t *bindata, *blank;
+	uint32_t binsize;
+	int err;
+	char fw_file_name[128];
+
+	usb = sdi->conn;
+	drvc = sdi->driver->context;
+	devc = sdi->priv;
+
+	if (devc->profile.description->device_variant < 0) {
+		snprintf(fw_file_name, 128, spartan_fw_pattern_hex, devc->profile.description->model);
+	} else {
+		snprintf(fw_file_name, 128, spartan_fw_pattern_hexd, devc->profile.description->model, devc->profile.description->device_variant);
+	}
+
+	blank = NULL;
+	image = firmware_cache_get(drvc->sr_ctx, fw_file_name, 0x020000, FALSE);
+	if (image) {
+		if (devc->spartan_hash && !strcmp(devc->spartan_hash, image->hash)
+				&& spartan_configured(usb->devhdl, devc->spartan_id)) {
+			sr_info("Spartan holds the firmware '%s' already, skipping the upload.",
+					fw_file_name);
+			firmware_image_unref(image);
+			return SR_OK;
+		}
+		bindata = image->data;
+		binsize = image->size;
+#ifdef KINGST_LAXXXX_EMULATOR
+	} else if (devc->emulator) {
+		sr_info("No Spartan firmware, uploading a blank one to the emulator.");
+		binsize = EMULATOR_BITSTREAM_SIZE;
+		bindata = blank = g_malloc0(binsize);
+#endif
+	} else {
+		return SR_ERR_MALLOC;
+	}
+
+	sr_dbg("Uploading Spartan firmware from '%s'...", fw_file_name);
+
+	g_free(devc->spartan_hash);
+	devc->spartan_hash = NULL;
+
+	err = upload_spartan_bitstream(drvc->sr_ctx->libusb_ctx, usb, bindata,
+			binsize, devc->spartan_id);
+	if (!err && image)
+		devc->spartan_hash = g_strdup(image->hash);
+
+	firmware_image_unref(image);
+	g_free(blank);
+
+	return err;
+}
+
 /*
  * Init the device for usage.
  */
@@ -795,14 +1150,43 @@ int kingst_laxxxx_init_spartan(struct libusb_device_handle *handle) {
 
 int kingst_laxxxx_receive_data(int fd, int revents, void *cb_data) {
 	struct timeval tv;
+	const struct sr_dev_inst *sdi;
 	struct drv_context *drvc;
+	struct dev_context *devc;
+	struct sr_usb_dev_inst *usb;
 
 	(void) fd;
 	(void) revents;
 
-	drvc = (struct drv_context*) cb_data;
+	sdi = cb_data;
+	drvc = sdi->driver->context;
+	devc = sdi->priv;
+	usb = sdi->conn;
+
+	/* The USB thread handles the events, deliver its data. */
+	if (devc->usb_thread) {
+		if (!devc->pipeline_thread) {
+			pipeline_drain(sdi);
+			packet_poll(sdi);
+		}
+		if (g_atomic_int_get(&devc->usb_thread_done))
+			usb_thread_finish(sdi);
+		return TRUE;
+	}
+
+	if (devc->pipeline_free)
+		pipeline_poll(sdi);
+
 	tv.tv_sec = tv.tv_usec = 0;
-	libusb_handle_events_timeout(drvc->sr_ctx->libusb_ctx, &tv);
+	kingst_laxxxx_usb_ops(usb->devhdl)->handle_events(drvc->sr_ctx->libusb_ctx,
+			&tv, NULL);
+
+	if (devc->pipeline_free && !devc->pipeline_thread)
+		pipeline_drain(sdi);
+
+	/* The conversion thread checks the age of its packets itself. */
+	if (!devc->pipeline_thread)
+		packet_poll(sdi);
 
 	return TRUE;
 }
@@ -811,121 +1195,395 @@ int kingst_laxxxx_acquisition_start(const struct sr_dev_inst *sdi) {
 	struct sr_dev_driver *di;
 	struct drv_context *drvc;
 	struct dev_context *devc;
+	struct sr_usb_dev_inst *usb;
+	const struct convert_engine *engine;
 	int timeout, ret;
 
 	di = sdi->driver;
 	drvc = di->context;
 	devc = sdi->priv;
+	usb = sdi->conn;
 
 	devc->ctx = drvc->sr_ctx;
+	devc->start_time = g_get_monotonic_time();
+	devc->sampling_start = 0;
+	devc->first_samples = 0;
 	devc->sent_samples = 0;
+	devc->received_words = 0;
 	devc->cur_channel = 0;
+	devc->skip_words = 0;
+	devc->submitted_transfers = 0;
+	devc->failed_transfers = 0;
+	devc->failed_bytes = 0;
+	devc->short_transfers = 0;
 	devc->empty_transfer_count = 0;
 	devc->acq_aborted = FALSE;
+	devc->usb_thread = NULL;
+	devc->usb_thread_done = FALSE;
+	devc->use_usb_thread = !devc->replay_path && devc->tunables.usb_thread;
 	memset(devc->channel_data, 0, 16 * 2);
 
+	if (devc->replay_path && (ret = replay_open(sdi)) != SR_OK)
+		return ret;
+
 	if (kingst_laxxxx_configure_channels(sdi) != SR_OK) {
 		sr_err("Failed to configure channels.");
+		replay_close(devc);
 		return SR_ERR;
 	}
 
-	timeout = get_timeout(devc);
-	usb_source_add(sdi->session, devc->ctx, timeout, kingst_laxxxx_receive_data,
-			drvc);
+	engine = kingst_laxxxx_get_convert_engine();
+	devc->transpose_groups = engine->specialized[devc->num_channels];
+	if (!devc->transpose_groups)
+		devc->transpose_groups = engine->transpose;
+
+	/*
+	 * Like fx2lafw, send 8-bit samples when only D0..D7 are enabled. The
+	 * soft trigger sizes its samples by the number of device channels,
+	 * so it keeps 16-bit ones.
+	 */
+	devc->unitsize = 2;
+	if (!(devc->cur_channels & 0xFF00) && !get_trigger(sdi))
+		devc->unitsize = 1;
+
+	latency_start(devc);
+
+	devc->num_frames = 0;
+	devc->frame_open = FALSE;
+	devc->frame_lost = 0;
+	devc->rearm_max = 0;
+	if (devc->limit_frames && !devc->limit_samples)
+		sr_warn("Segmented capture needs a sample limit, capturing one segment.");
+
+	devc->bitplanes = get_env_uint(BITPLANES_ENV, 0) != 0;
+	if (devc->bitplanes && (get_trigger(sdi) || devc->limit_frames)) {
+		sr_warn("Soft trigger and frames need converted samples, not sending bitplanes.");
+		devc->bitplanes = FALSE;
+	}
+
+	if ((ret = record_start(sdi)) != SR_OK) {
+		replay_close(devc);
+		return ret;
+	}
 
-	devc->convbuffer_size = (get_buffer_size(devc) / devc->num_channels) * 16
-			+ 32;
+	devc->convert_threads = get_env_uint(CONVERT_THREADS_ENV, 1);
+	if (!devc->bitplanes
+			&& (ret = kingst_laxxxx_convert_pool_start(devc)) != SR_OK) {
+		record_stop(devc);
+		replay_close(devc);
+		return ret;
+	}
+
+	packet_start(devc);
+
+	if (devc->replay_file) {
+		/* At full speed the source runs on every loop iteration. */
+		sr_session_source_add(sdi->session, -1, 0,
+				devc->replay_realtime ? REPLAY_POLL_MS : 0,
+				replay_receive_data, (void*) sdi);
+	} else if (devc->use_usb_thread) {
+		sr_session_source_add(sdi->session, -1, 0, USB_THREAD_POLL_MS,
+				kingst_laxxxx_receive_data, (void*) sdi);
+	} else if ((timeout = kingst_laxxxx_usb_ops(usb->devhdl)->poll_ms)) {
+		sr_session_source_add(sdi->session, -1, 0, timeout,
+				kingst_laxxxx_receive_data, (void*) sdi);
+	} else {
+		timeout = get_timeout(devc);
+		/* Wake up in time to send the merged packets. */
+		if (devc->packet_buffer && devc->packet_age)
+			timeout = MIN(timeout, MAX(devc->packet_age / 1000, 1));
+		usb_source_add(sdi->session, devc->ctx, timeout, kingst_laxxxx_receive_data,
+				(void*) sdi);
+	}
+
+	/* One cache sized block for each conversion thread. */
+	devc->convbuffer_size = CONVERT_BLOCK_SIZE;
+	if (devc->convert_pool)
+		devc->convbuffer_size *= devc->convert_threads;
 
 	devc->convbuffer = g_try_malloc(devc->convbuffer_size);
 
 	if (devc->convbuffer) {
-		if ((ret = command_start_acquisition(sdi)) != SR_OK) {
-			kingst_laxxxx_acquisition_stop(sdi);
-			if (devc->convbuffer)
-				g_free(devc->convbuffer);
-			devc->convbuffer = NULL;
+		if (devc->replay_file)
+			return replay_start(sdi);
+
+		std_session_send_df_header(sdi);
+
+		/* The transfers wait for the first samples before sampling starts. */
+		if ((ret = command_start_acquisition(sdi)) != SR_OK
+				|| (ret = start_transfers(sdi)) != SR_OK
+				|| (ret = command_start_sampling(sdi)) != SR_OK) {
+			abort_start(sdi);
 			return ret;
 		}
 
-		start_transfers(sdi);
+		if (devc->use_usb_thread)
+			usb_thread_start(sdi);
 	} else {
 		sr_err("Failed to allocate memory for data buffer.");
+		kingst_laxxxx_convert_pool_stop(devc);
+		packet_stop(sdi);
 		return SR_ERR_MALLOC;
 	}
 
 	return SR_OK;
 }
 
-static int command_start_acquisition(const struct sr_dev_inst *sdi) {
-	struct dev_context *devc;
-	struct sr_usb_dev_inst *usb;
-	int err;
-	uint8_t data[1];
-	struct channels_config chann_cfg;
-	struct samples_config smpl_cfg;
-
-	devc = sdi->priv;
-	usb = sdi->conn;
-	usb = sdi->conn;
-
-	data[0] = 1;
-	err = control_out(usb->devhdl, CMD_CONTROL, CMD_CONTROL_0x03, data, 1);
-	if (err) {
-		sr_err("Start configure channels failed.");
-		return err;
+/*
+ * Returns the libusb error for the status of a completed transfer, SR_OK
+ * when it completed.
+ */
+static int transfer_error(const struct libusb_transfer *transfer) {
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return SR_OK;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	default:
+		return LIBUSB_ERROR_IO;
 	}
+}
 
-	memset(&chann_cfg, 0, sizeof(struct channels_config));
-	chann_cfg.channels_mask = devc->cur_channels;
+/*
+ * Start sequence.
+ *
+ * The configuration requests are submitted at once as asynchronous
+ * control transfers: the device handles them in order on the control
+ * endpoint, without a round trip through the host between them. The
+ * bulk IN transfers are then posted, and only then CMD_SAMPLING_START is
+ * sent, so the first samples always find a transfer waiting for them.
+ */
+struct control_request {
+	uint8_t request;
+	uint16_t value;
+	uint8_t *data;
+	uint16_t size;
+	const char *error;
+};
+
+struct control_sequence {
+	const struct control_request *requests;
+	struct libusb_transfer *transfers[8];
+	int num_requests;
+	int pending;
+	/* Index of the first failed request, num_requests -- none */
+	int failed;
+	int status;
+	/* Given up, the last callback frees the sequence */
+	gboolean abandoned;
+};
 
-	/*
-	 * Kingst LA-1010 without internal memory,
-	 * so the code below is not irrelevant.
-	 * Иut there is no complete certainty about this.
-	 */
-//	if (devc->hw_trigger_channel > 0) {
-//		switch (devc->hw_trigger_type) {
-//		case SR_TRIGGER_ZERO:
-//			chann_cfg.trigger_mask_0 = 1 << devc->hw_trigger_channel;
-//			chann_cfg.trigger_mask_1 = 1 << devc->hw_trigger_channel;
-//			break;
-//		case SR_TRIGGER_ONE:
-//			chann_cfg.trigger_mask_0 = 1 << devc->hw_trigger_channel;
-//			chann_cfg.trigger_mask_1 = 1 << devc->hw_trigger_channel;
-//			chann_cfg.trigger_mask_2 = 1 << devc->hw_trigger_channel;
-//			break;
-//		case SR_TRIGGER_RISING:
-//			chann_cfg.trigger_mask_0 = 1 << devc->hw_trigger_channel;
-//			break;
-//		case SR_TRIGGER_FALLING:
-//			chann_cfg.trigger_mask_0 = 1 << devc->hw_trigger_channel;
-//			chann_cfg.trigger_mask_2 = 1 << devc->hw_trigger_channel;
-//			break;
-//		}
-//	}
+static void LIBUSB_CALL
+control_sequence_cb(struct libusb_transfer *transfer) {
+	struct control_sequence *seq;
+	int i, ret;
 
-	sr_info("Set channels mask: %08X, triggers mask: %08X, %08X, %08X",
-			chann_cfg.channels_mask,
-			chann_cfg.trigger_mask_0,
-			chann_cfg.trigger_mask_1,
-			chann_cfg.trigger_mask_2);
+	seq = transfer->user_data;
 
-	err = control_out(usb->devhdl, CMD_CONTROL, CMD_CONTROL_CHAN_SELECT, (uint8_t*) &chann_cfg, sizeof(struct channels_config));
-	if (err) {
-		sr_err("Set channel and trigger masks failed.");
-		return err;
+	if (seq->abandoned) {
+		libusb_free_transfer(transfer);
+		if (--seq->pending == 0)
+			g_free(seq);
+		return;
 	}
 
-	memset(&smpl_cfg, 0, sizeof(struct samples_config));
-	smpl_cfg.samples_count = devc->limit_samples;
-	smpl_cfg.samples_rate = SAMPLING_BASE_FREQUENCY / devc->cur_samplerate * 0x100;
+	for (i = 0; i < seq->num_requests; i++)
+		if (seq->transfers[i] == transfer)
+			break;
 
-	/*
-	 * Kingst LA-1010 without internal memory,
-	 * so the code below is not irrelevant.
-	 * Иut there is no complete certainty about this.
-	 */
-//	smpl_cfg.trigger_pos = smpl_cfg.samples_count * 0.trig_percent * 0x100;
+	ret = transfer_error(transfer);
+	if (ret == SR_OK && transfer->actual_length != seq->requests[i].size)
+		ret = SR_ERR;
+
+	if (ret != SR_OK && i < seq->failed) {
+		seq->failed = i;
+		seq->status = ret;
+	}
+
+	seq->transfers[i] = NULL;
+	seq->pending--;
+	libusb_free_transfer(transfer);
+}
+
+/*
+ * Sends the vendor requests in order and waits for all of them. Returns
+ * SR_OK, or the error of the first failed request after logging it.
+ */
+static int control_out_sequence(const struct sr_dev_inst *sdi,
+								const struct control_request *requests,
+								int num_requests) {
+	struct dev_context *devc;
+	struct sr_usb_dev_inst *usb;
+	struct control_sequence *seq;
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;
+	struct timeval tv;
+	int64_t deadline;
+	int i, ret;
+
+	devc = sdi->priv;
+	usb = sdi->conn;
+
+	/* The callbacks may outlive this call if the events can't be handled. */
+	if (!(seq = g_try_new0(struct control_sequence, 1)))
+		return SR_ERR_MALLOC;
+	seq->requests = requests;
+	seq->num_requests = MIN(num_requests, (int) G_N_ELEMENTS(seq->transfers));
+	seq->failed = seq->num_requests;
+	seq->status = SR_OK;
+
+	for (i = 0; i < seq->num_requests; i++) {
+		transfer = libusb_alloc_transfer(0);
+		buffer = g_try_malloc(LIBUSB_CONTROL_SETUP_SIZE + requests[i].size);
+		if (!transfer || !buffer) {
+			libusb_free_transfer(transfer);
+			g_free(buffer);
+			seq->failed = i;
+			seq->status = SR_ERR_MALLOC;
+			break;
+		}
+
+		libusb_fill_control_setup(buffer,
+				LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+				requests[i].request, requests[i].value, 0, requests[i].size);
+		if (requests[i].size)
+			memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, requests[i].data,
+					requests[i].size);
+		libusb_fill_control_transfer(transfer, usb->devhdl, buffer,
+				control_sequence_cb, seq, USB_TIMEOUT);
+		transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+		seq->transfers[i] = transfer;
+		if ((ret = submit_transfer(transfer)) < 0) {
+			seq->transfers[i] = NULL;
+			libusb_free_transfer(transfer);
+			seq->failed = i;
+			seq->status = ret;
+			break;
+		}
+		seq->pending++;
+	}
+
+	/*
+	 * The submitted requests time out on their own. If the events can't
+	 * be handled, cancel them once and wait for the cancellation only
+	 * until the deadline.
+	 */
+	deadline = 0;
+	while (seq->pending > 0) {
+		if (deadline && g_get_monotonic_time() >= deadline) {
+			sr_err("%d start requests didn't finish, abandoning them.",
+					seq->pending);
+			seq->abandoned = TRUE;
+			return SR_ERR_TIMEOUT;
+		}
+
+		tv.tv_sec = 0;
+		tv.tv_usec = USB_TIMEOUT * 100;
+		ret = kingst_laxxxx_usb_ops(usb->devhdl)->handle_events(
+				devc->ctx->libusb_ctx, &tv, NULL);
+		if (ret >= 0 || ret == LIBUSB_ERROR_INTERRUPTED)
+			continue;
+
+		if (!deadline) {
+			sr_err("Failed to handle the start requests: %s.",
+					libusb_error_name(ret));
+			for (i = 0; i < seq->num_requests; i++)
+				if (seq->transfers[i])
+					cancel_transfer(seq->transfers[i]);
+			if (seq->failed == seq->num_requests) {
+				seq->failed = 0;
+				seq->status = ret;
+			}
+			deadline = g_get_monotonic_time() + USB_TIMEOUT * 1000;
+		}
+		/* Don't spin on an event loop failing at once. */
+		g_usleep(1000);
+	}
+
+	ret = SR_OK;
+	if (seq->failed < seq->num_requests) {
+		sr_err("%s: %s.", requests[seq->failed].error,
+				seq->status < 0 ? libusb_error_name(seq->status)
+				: "wrong response size");
+		ret = seq->status < 0 ? seq->status : SR_ERR;
+	}
+	g_free(seq);
+
+	return ret;
+}
+
+static int command_start_acquisition(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	uint8_t control_data[1], smpl_data[1];
+	struct channels_config chann_cfg;
+	struct samples_config smpl_cfg;
+	const struct control_request requests[] = {
+		{ CMD_CONTROL, CMD_CONTROL_0x03, control_data, 1,
+				"Start configure channels failed" },
+		{ CMD_CONTROL, CMD_CONTROL_CHAN_SELECT, (uint8_t*) &chann_cfg,
+				sizeof(struct channels_config),
+				"Set channel and trigger masks failed" },
+		{ CMD_CONTROL, CMD_CONTROL_SAMPLE_RATE, (uint8_t*) &smpl_cfg,
+				sizeof(struct samples_config), "Set sample rate failed" },
+		{ CMD_RESET_BULK_STATE, 0, NULL, 0, "Reset bulk state failed" },
+		{ CMD_CONTROL, CMD_CONTROL_SMPL, smpl_data, 1,
+				"Set sampling status failed" },
+	};
+
+	devc = sdi->priv;
+
+	control_data[0] = 1;
+
+	memset(&chann_cfg, 0, sizeof(struct channels_config));
+	chann_cfg.channels_mask = devc->cur_channels;
+
+	/*
+	 * Kingst LA-1010 without internal memory,
+	 * so the code below is not irrelevant.
+	 * Иut there is no complete certainty about this.
+	 */
+//	if (devc->hw_trigger_channel > 0) {
+//		switch (devc->hw_trigger_type) {
+//		case SR_TRIGGER_ZERO:
+//			chann_cfg.trigger_mask_0 = 1 << devc->hw_trigger_channel;
+//			chann_cfg.trigger_mask_1 = 1 << devc->hw_trigger_channel;
+//			break;
+//		case SR_TRIGGER_ONE:
+//			chann_cfg.trigger_mask_0 = 1 << devc->hw_trigger_channel;
+//			chann_cfg.trigger_mask_1 = 1 << devc->hw_trigger_channel;
+//			chann_cfg.trigger_mask_2 = 1 << devc->hw_trigger_channel;
+//			break;
+//		case SR_TRIGGER_RISING:
+//			chann_cfg.trigger_mask_0 = 1 << devc->hw_trigger_channel;
+//			break;
+//		case SR_TRIGGER_FALLING:
+//			chann_cfg.trigger_mask_0 = 1 << devc->hw_trigger_channel;
+//			chann_cfg.trigger_mask_2 = 1 << devc->hw_trigger_channel;
+//			break;
+//		}
+//	}
+
+	sr_info("Set channels mask: %08X, triggers mask: %08X, %08X, %08X",
+			chann_cfg.channels_mask,
+			chann_cfg.trigger_mask_0,
+			chann_cfg.trigger_mask_1,
+			chann_cfg.trigger_mask_2);
+
+	memset(&smpl_cfg, 0, sizeof(struct samples_config));
+	smpl_cfg.samples_count = devc->limit_samples;
+	smpl_cfg.samples_rate = SAMPLING_BASE_FREQUENCY / devc->cur_samplerate * 0x100;
+
+	/*
+	 * Kingst LA-1010 without internal memory,
+	 * so the code below is not irrelevant.
+	 * Иut there is no complete certainty about this.
+	 */
+//	smpl_cfg.trigger_pos = smpl_cfg.samples_count * 0.trig_percent * 0x100;
 
 
 	sr_info("Set samples count: %08X, trigger pos: %08X, sample rate: %08lX -> %08X",
@@ -933,31 +1591,30 @@ static int command_start_acquisition(const struct sr_dev_inst *sdi) {
 			smpl_cfg.trigger_pos,
 			devc->cur_samplerate,
 			smpl_cfg.samples_rate);
-	err = control_out(usb->devhdl, CMD_CONTROL, CMD_CONTROL_SAMPLE_RATE, (uint8_t*) &smpl_cfg, sizeof(struct samples_config));
-	if (err) {
-		sr_err("Set sample rate failed.");
-		return err;
-	}
 
-	err = control_out(usb->devhdl, CMD_RESET_BULK_STATE, 0, NULL, 0);
-	if (err) {
-		sr_err("Reset bulk state failed.");
-		return err;
-	}
+	smpl_data[0] = CMD_SMPL_STATUS_RUN;
 
-	data[0] = CMD_SMPL_STATUS_RUN;
-	err = control_out(usb->devhdl, CMD_CONTROL, CMD_CONTROL_SMPL, data, 1);
-	if (err) {
-		sr_err("Set sampling status failed.");
-		return err;
-	}
+	return control_out_sequence(sdi, requests, G_N_ELEMENTS(requests));
+}
+
+static int command_start_sampling(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct sr_usb_dev_inst *usb;
+	int err;
+
+	devc = sdi->priv;
+	usb = sdi->conn;
 
+	devc->sampling_start = g_get_monotonic_time();
 	err = control_out(usb->devhdl, CMD_SAMPLING_START, CMD_CONTROL_SMPL, NULL, 0);
 	if (err) {
-		sr_err("Start sampling failed.");
-		return err;
+		sr_err("Start sampling failed: %s.", libusb_error_name(err));
+		return SR_ERR;
 	}
 
+	sr_dbg("Sampling started %" PRId64 " us after the acquisition start.",
+			devc->sampling_start - devc->start_time);
+
 	return SR_OK;
 }
 
@@ -970,8 +1627,21 @@ int kingst_laxxxx_acquisition_stop(const struct sr_dev_inst *sdi) {
 	usb = sdi->conn;
 	devc = sdi->priv;
 
+	/* Transfers are cancelled only by the thread handling the events. */
+	if (devc->usb_thread && g_thread_self() != devc->usb_thread) {
+		g_atomic_int_set(&devc->stop_requested, TRUE);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+		libusb_interrupt_event_handler(devc->ctx->libusb_ctx);
+#endif
+		return SR_OK;
+	}
+
 	devc->acq_aborted = TRUE;
 
+	/* The replay source finishes the acquisition on its next call. */
+	if (devc->replay_file)
+		return SR_OK;
+
 	/*
 	 * There are need send request to stop sampling.
 	 */
@@ -984,7 +1654,7 @@ int kingst_laxxxx_acquisition_stop(const struct sr_dev_inst *sdi) {
 	sr_dbg("kingst_laxxxx_acquisition_stop(): cancel %d transfers", devc->num_transfers);
 	for (i = devc->num_transfers - 1; i >= 0; i--) {
 		if (devc->transfers[i]) {
-			ret = libusb_cancel_transfer(devc->transfers[i]);
+			ret = cancel_transfer(devc->transfers[i]);
 			if (ret != LIBUSB_ERROR_NOT_FOUND) {
 				sr_err(
 						"kingst_laxxxx_acquisition_stop(): cancel %d transfer error %d. libusb err: %s",
@@ -1133,6 +1803,14 @@ int kingst_laxxxx_dev_open(const struct sr_dev_inst *sdi) {
 	devc = sdi->priv;
 	usb = sdi->conn;
 
+#ifdef KINGST_LAXXXX_EMULATOR
+	if (devc->emulator) {
+		usb->devhdl = devc->emulator;
+		sr_info("Opened emulated device.");
+		return SR_OK;
+	}
+#endif
+
 	device_count = libusb_get_device_list(drvc->sr_ctx->libusb_ctx, &devlist);
 	if (device_count < 0) {
 		sr_err("Failed to get device list: %s.",
@@ -1234,30 +1912,58 @@ int kingst_laxxxx_abort_acquisition_request(libusb_device_handle *handle) {
 									1000);
 	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
 
-	ret = libusb_submit_transfer(transfer);
-	if (ret < 0) {
+	/* The transfer owns the buffer, LIBUSB_TRANSFER_FREE_BUFFER frees it. */
+	ret = submit_transfer(transfer);
+	if (ret < 0)
 		libusb_free_transfer(transfer);
-		if (transfer->buffer) {
-			g_free(transfer->buffer);
-			transfer->buffer = NULL;
-		}
-		return ret;
-	}
 
 	return ret;
 }
 
 static void finish_acquisition(const struct sr_dev_inst *sdi) {
 	struct dev_context *devc;
+	struct sr_usb_dev_inst *usb;
 
 	devc = sdi->priv;
+	usb = sdi->conn;
+
+	/* Deliver everything queued for the conversion thread first. */
+	pipeline_stop(sdi);
+	kingst_laxxxx_convert_pool_stop(devc);
+	packet_stop(sdi);
+
+	if (devc->frame_open) {
+		send_frame(sdi, FALSE);
+		/* The segment cut short by the stop. */
+		if (devc->limit_frames) {
+			devc->num_frames++;
+			send_segment(sdi, 0);
+		}
+	}
+	if (devc->num_frames)
+		sr_info("Captured %lu segments, longest re-arm %ld us.",
+				devc->num_frames, devc->rearm_max);
+
+	latency_stop(sdi);
+
+	if (devc->failed_transfers)
+		sr_warn("%d failed transfers, 0x%lx bytes received by them.",
+				devc->failed_transfers, devc->failed_bytes);
+	sr_dbg("%d short transfers.", devc->short_transfers);
 
 	std_session_send_df_end(sdi);
 
-	usb_source_remove(sdi->session, devc->ctx);
+	if (devc->replay_file || devc->use_usb_thread
+			|| kingst_laxxxx_usb_ops(usb->devhdl)->poll_ms)
+		sr_session_source_remove(sdi->session, -1);
+	else
+		usb_source_remove(sdi->session, devc->ctx);
+
+	record_stop(devc);
 
 	devc->num_transfers = 0;
 	g_free(devc->transfers);
+	devc->transfers = NULL;
 
 	if (devc->convbuffer) {
 		g_free(devc->convbuffer);
@@ -1268,6 +1974,45 @@ static void finish_acquisition(const struct sr_dev_inst *sdi) {
 		soft_trigger_logic_free(devc->stl);
 		devc->stl = NULL;
 	}
+
+	replay_close(devc);
+}
+
+/*
+ * Undoes a failed start: stops the device, cancels the transfers already
+ * submitted and handles their events, so the acquisition is finished
+ * when the error is returned.
+ */
+static void abort_start(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct sr_usb_dev_inst *usb;
+	struct timeval tv;
+	int64_t deadline;
+
+	devc = sdi->priv;
+	usb = sdi->conn;
+
+	kingst_laxxxx_acquisition_stop(sdi);
+
+	/* The last freed transfer finishes the acquisition. */
+	if (!devc->submitted_transfers) {
+		finish_acquisition(sdi);
+		return;
+	}
+
+	deadline = g_get_monotonic_time() + USB_TIMEOUT * 1000;
+	while (devc->submitted_transfers > 0) {
+		if (g_get_monotonic_time() >= deadline) {
+			sr_err("%d transfers weren't cancelled in time.",
+					devc->submitted_transfers);
+			return;
+		}
+		tv.tv_sec = 0;
+		tv.tv_usec = USB_TIMEOUT * 100;
+		if (kingst_laxxxx_usb_ops(usb->devhdl)->handle_events(
+				devc->ctx->libusb_ctx, &tv, NULL) < 0)
+			g_usleep(1000);
+	}
 }
 
 static void free_transfer(struct libusb_transfer *transfer) {
@@ -1278,11 +2023,7 @@ static void free_transfer(struct libusb_transfer *transfer) {
 	sdi = transfer->user_data;
 	devc = sdi->priv;
 
-	libusb_free_transfer(transfer);
-	if (transfer->buffer) {
-		g_free(transfer->buffer);
-		transfer->buffer = NULL;
-	}
+	pool_put_transfer(devc, transfer);
 
 	for (i = 0; i < devc->num_transfers; i++) {
 		if (devc->transfers[i] == transfer) {
@@ -1293,14 +2034,30 @@ static void free_transfer(struct libusb_transfer *transfer) {
 
 	devc->submitted_transfers--;
 
-	if (devc->submitted_transfers == 0)
+	if (devc->submitted_transfers > 0)
+		return;
+
+	/* The session thread finishes after joining the USB thread. */
+	if (devc->usb_thread && g_thread_self() == devc->usb_thread)
+		g_atomic_int_set(&devc->usb_thread_done, TRUE);
+	else
 		finish_acquisition(sdi);
 }
 
 static void resubmit_transfer(struct libusb_transfer *transfer) {
+	struct sr_dev_inst *sdi;
+	struct dev_context *devc;
 	int ret;
 
-	if ((ret = libusb_submit_transfer(transfer)) == LIBUSB_SUCCESS)
+	sdi = transfer->user_data;
+	devc = sdi->priv;
+
+	if (devc->autotune && !autotune_transfer(sdi, transfer)) {
+		free_transfer(transfer);
+		return;
+	}
+
+	if ((ret = submit_transfer(transfer)) == LIBUSB_SUCCESS)
 		return;
 
 	sr_err("%s: %s", __func__, libusb_error_name(ret));
@@ -1309,249 +2066,1859 @@ static void resubmit_transfer(struct libusb_transfer *transfer) {
 }
 
 /*
- * Sampling data same as Saleae Logic16.
+ * Send the sample data as it comes from the device, one bitplane per
+ * enabled channel. Transfers aren't aligned to channel groups, so the
+ * first word of every channel and its sample offset are computed from
+ * the number of words received so far.
  */
-static size_t convert_sample_data(struct dev_context *devc,
-									uint8_t *dest,
-									size_t destcnt,
-									const uint8_t *src,
-									size_t srccnt) {
-	uint16_t *channel_data;
-	int i, cur_channel;
-	size_t ret = 0;
-	uint16_t sample, channel_mask;
-
-	srccnt /= 2;
-
-	channel_data = devc->channel_data;
-	cur_channel = devc->cur_channel;
-
-	while (srccnt--) {
-		sample = src[0] | (src[1] << 8);
-		src += 2;
-
-		channel_mask = devc->channel_masks[cur_channel];
-
-		for (i = 0; i < 16; ++i, sample >>= 1)
-			if (sample & 1)
-				channel_data[i] |= channel_mask;
-
-		if (++cur_channel == devc->num_channels) {
-			cur_channel = 0;
-			if (destcnt < 16 * 2) {
-				sr_err("Conversion buffer too small! dstcnt %ld, srccnt %ld",
-						destcnt, srccnt);
-				break;
-			}
-			memcpy(dest, channel_data, 16 * 2);
-			memset(channel_data, 0, 16 * 2);
-			dest += 16 * 2;
-			ret += 16;
-			destcnt -= 16 * 2;
-		}
-	}
-
-	devc->cur_channel = cur_channel;
-
-	return ret;
-}
-
-static void LIBUSB_CALL
-receive_transfer(struct libusb_transfer *transfer) {
-	struct sr_dev_inst *sdi;
+static gboolean process_bitplanes(const struct sr_dev_inst *sdi,
+									const uint8_t *buffer,
+									size_t length) {
 	struct dev_context *devc;
-	gboolean packet_has_error = FALSE;
-	size_t num_samples, new_samples;
-	int trigger_offset, pre_trigger_samples;
-	struct sr_datafeed_logic logic;
+	struct kingst_laxxxx_bitplanes bitplanes;
+	struct kingst_laxxxx_bitplane *plane;
 	struct sr_datafeed_packet packet;
+	size_t num_words, first_word;
+	uint64_t word_index, num_samples;
+	int c, n;
 
-	sdi = transfer->user_data;
 	devc = sdi->priv;
+	n = devc->num_channels;
+	num_words = length / 2;
 
-	/*
-	 * If acquisition has already ended, just free any queued up
-	 * transfer that come in.
-	 */
-	if (devc->acq_aborted) {
+	bitplanes.num_planes = 0;
+	for (c = 0; c < n; c++) {
+		first_word = (c + n - devc->received_words % n) % n;
+		if (first_word >= num_words)
+			continue;
 
-		free_transfer(transfer);
-		return;
+		word_index = devc->received_words + first_word;
+		plane = &bitplanes.planes[bitplanes.num_planes];
+		plane->channel = __builtin_ctz(devc->channel_masks[c]);
+		plane->sample_offset = (word_index / n) * 16;
+		plane->stride = n * 2;
+		plane->data = buffer + first_word * 2;
+
+		num_samples = ((num_words - first_word + n - 1) / n) * 16;
+		if (devc->limit_samples) {
+			if (plane->sample_offset >= devc->limit_samples)
+				continue;
+			if (num_samples > devc->limit_samples - plane->sample_offset)
+				num_samples = devc->limit_samples - plane->sample_offset;
+		}
+		plane->num_samples = num_samples;
+
+		bitplanes.num_planes++;
 	}
 
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		sr_err("receive_transfer(): no device");
-		kingst_laxxxx_acquisition_stop(sdi);
-		free_transfer(transfer);
-		return;
-	case LIBUSB_TRANSFER_COMPLETED:
-	case LIBUSB_TRANSFER_TIMED_OUT: /* We may have received some data though. */
-		break;
-	default:
-		packet_has_error = TRUE;
-		break;
+	devc->received_words += num_words;
+
+	if (bitplanes.num_planes) {
+		packet.type = KINGST_LAXXXX_DF_BITPLANES;
+		packet.payload = &bitplanes;
+		session_send(sdi, &packet);
 	}
 
-	if (transfer->actual_length == 0 || packet_has_error) {
-		devc->empty_transfer_count++;
-		if (devc->empty_transfer_count > MAX_EMPTY_TRANSFERS) {
-			sr_err("receive_transfer(): MAX_EMPTY_TRANSFERS exceeded");
-			kingst_laxxxx_acquisition_stop(sdi);
-			free_transfer(transfer);
-		} else {
-			sr_err(
-					"receive_transfer(): resubmit transfer due error: actual_length %d, has_error %d",
-					transfer->actual_length, packet_has_error);
-			resubmit_transfer(transfer);
-		}
-		return;
-	} else {
-		devc->empty_transfer_count = 0;
+	/* Only the complete channel groups are counted as sent. */
+	devc->sent_samples = (devc->received_words / n) * 16;
+
+	if (devc->limit_samples && (devc->sent_samples >= devc->limit_samples)) {
+		sr_dbg("process_bitplanes(): samples limit reached %ld",
+				devc->sent_samples);
+		return FALSE;
 	}
 
-	logic.data = devc->convbuffer;
-	logic.unitsize = 2;
+	return TRUE;
+}
 
-	packet.type = SR_DF_LOGIC;
-	packet.payload = &logic;
+/*
+ * Merged SR_DF_LOGIC packets.
+ *
+ * With SR_CONF_PACKET_SIZE set, the converted samples of several
+ * blocks and transfers are copied into packets of that size, independent
+ * of the transfer size. A packet is sent when full, or once its first
+ * samples are older than SR_CONF_PACKET_AGE; the age is checked
+ * as samples arrive and by packet_poll(), from the session source or the
+ * conversion thread, whichever fills the packets. The rest is sent at the
+ * end of the acquisition. Blocks at least as large as a packet are sent
+ * as they are.
+ *
+ * With a latency bound the transfers fill within half of it, the other
+ * half is left to the packet age. The latency is measured when the
+ * samples are sent, not when they are merged.
+ */
+static void packet_start(struct dev_context *devc) {
+	size_t size;
 
-	new_samples = convert_sample_data(devc,
-										devc->convbuffer,
-										devc->convbuffer_size,
-										(uint8_t*) transfer->buffer,
-										transfer->actual_length);
-	if (new_samples == 0) {
-		if (transfer->actual_length) {
-			sr_err("receive_transfer(): convert data failed");
-			kingst_laxxxx_acquisition_stop(sdi);
-			free_transfer(transfer);
-			return;
-		} else {
-			resubmit_transfer(transfer);
-			return;
-		}
-	}
+	devc->packet_buffer = NULL;
+	devc->packet_length = 0;
+	devc->packet_completed = 0;
+	devc->packets_sent = 0;
+	devc->packet_bytes = 0;
+	devc->data_completed = 0;
 
-	if (devc->trigger_fired) {
-		if (devc->limit_samples
-				&& (new_samples > devc->limit_samples - devc->sent_samples))
-			new_samples = devc->limit_samples - devc->sent_samples;
-		logic.length = new_samples * 2;
-		sr_session_send(sdi, &packet);
-		devc->sent_samples += new_samples;
-	} else {
-		trigger_offset = soft_trigger_logic_check(devc->stl,
-													devc->convbuffer,
-													new_samples * 2,
-													&pre_trigger_samples);
-		if (trigger_offset > -1) {
-			devc->sent_samples += pre_trigger_samples;
-			packet.type = SR_DF_LOGIC;
-			packet.payload = &logic;
-			num_samples = new_samples - trigger_offset;
-			if (devc->limit_samples
-					&& (num_samples > devc->limit_samples - devc->sent_samples))
-				num_samples = devc->limit_samples - devc->sent_samples;
-			logic.length = num_samples * 2;
-			logic.data = devc->convbuffer + trigger_offset * 2;
-			sr_session_send(sdi, &packet);
-			devc->sent_samples += num_samples;
+	size = devc->tunables.packet_size & ~1;
+	if (!size || devc->bitplanes)
+		return;
 
-			devc->trigger_fired = TRUE;
-		}
+	if (!(devc->packet_buffer = g_try_malloc(size))) {
+		sr_warn("Packet buffer malloc failed, sending unmerged packets.");
+		return;
 	}
+	devc->packet_size = size;
+	devc->packet_age = devc->tunables.packet_age * 1000;
+	if (devc->max_latency && devc->packet_age > (int64_t) devc->max_latency / 2)
+		devc->packet_age = devc->max_latency / 2;
 
-	if (devc->limit_samples && (devc->sent_samples >= devc->limit_samples)) {
-		sr_dbg("receive_transfer(): samples limit reached %ld",
-				devc->sent_samples);
-		kingst_laxxxx_acquisition_stop(sdi);
-		free_transfer(transfer);
-	} else
-		resubmit_transfer(transfer);
+	sr_info("Merging samples into packets of 0x%lx bytes, at most %lu ms old.",
+			size, devc->packet_age / 1000);
 }
 
-int kingst_laxxxx_configure_channels(const struct sr_dev_inst *sdi) {
+static void packet_stop(const struct sr_dev_inst *sdi) {
 	struct dev_context *devc;
-	const GSList *l;
-	struct sr_channel *ch;
-	uint16_t channel_bit;
 
 	devc = sdi->priv;
-	devc->num_channels = 0;
-	devc->cur_channels = 0;
-	for (l = sdi->channels; l; l = l->next) {
+
+	flush_logic(sdi);
+
+	if (devc->packets_sent)
+		sr_info("Sent %lu logic packets, 0x%lx bytes on average.",
+				devc->packets_sent, devc->packet_bytes / devc->packets_sent);
+
+	g_free(devc->packet_buffer);
+	devc->packet_buffer = NULL;
+}
+
+static void send_packet(const struct sr_dev_inst *sdi,
+						const struct sr_datafeed_packet *packet) {
+	struct dev_context *devc;
+	const struct sr_datafeed_logic *logic;
+
+	devc = sdi->priv;
+	logic = packet->payload;
+
+	session_send(sdi, packet);
+	devc->packets_sent++;
+	devc->packet_bytes += logic->length;
+}
+
+static void flush_logic(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct sr_datafeed_logic logic;
+	struct sr_datafeed_packet packet;
+
+	devc = sdi->priv;
+
+	if (!devc->packet_length)
+		return;
+
+	logic.length = devc->packet_length;
+	logic.unitsize = devc->unitsize;
+	logic.data = devc->packet_buffer;
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	send_packet(sdi, &packet);
+
+	devc->packet_length = 0;
+
+	if (devc->max_latency && devc->packet_completed)
+		latency_update(sdi, devc->packet_completed, devc->packet_completed_length);
+	devc->packet_completed = 0;
+}
+
+/* Send the merged packet once it is too old. */
+static void packet_poll(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+
+	if (devc->packet_length
+			&& g_get_monotonic_time() - devc->packet_time >= devc->packet_age)
+		flush_logic(sdi);
+}
+
+/* The packet's oldest samples come from the transfer being processed. */
+static void packet_begin(struct dev_context *devc, int64_t now) {
+	devc->packet_time = now;
+	devc->packet_completed = devc->data_completed;
+	devc->packet_completed_length = devc->data_length;
+}
+
+static void send_logic(const struct sr_dev_inst *sdi,
+						const struct sr_datafeed_packet *packet) {
+	struct dev_context *devc;
+	const struct sr_datafeed_logic *logic;
+	const uint8_t *data;
+	size_t length, n;
+	int64_t now;
+
+	devc = sdi->priv;
+	logic = packet->payload;
+
+	if (!devc->packet_buffer
+			|| (!devc->packet_length && logic->length >= devc->packet_size)) {
+		send_packet(sdi, packet);
+		if (devc->packet_buffer && devc->max_latency && devc->data_completed)
+			latency_update(sdi, devc->data_completed, devc->data_length);
+		return;
+	}
+
+	now = g_get_monotonic_time();
+	if (!devc->packet_length)
+		packet_begin(devc, now);
+
+	data = logic->data;
+	length = logic->length;
+	while (length) {
+		n = MIN(length, devc->packet_size - devc->packet_length);
+		memcpy(devc->packet_buffer + devc->packet_length, data, n);
+		devc->packet_length += n;
+		data += n;
+		length -= n;
+
+		if (devc->packet_length == devc->packet_size) {
+			flush_logic(sdi);
+			packet_begin(devc, now);
+		}
+	}
+
+	if (devc->packet_length && now - devc->packet_time >= devc->packet_age)
+		flush_logic(sdi);
+}
+
+/*
+ * Segmented capture.
+ *
+ * With SR_CONF_LIMIT_FRAMES set, every 'limit_samples' segment is sent
+ * between SR_DF_FRAME_BEGIN and SR_DF_FRAME_END. The stream and the
+ * transfers keep running: after a segment the soft trigger is re-armed
+ * and checks the samples following it in the same block, so no sample
+ * is skipped between segments and the dead time is the re-arm time only.
+ */
+static void send_frame(const struct sr_dev_inst *sdi, gboolean begin) {
+	struct dev_context *devc;
+	struct sr_datafeed_packet packet;
+
+	devc = sdi->priv;
+
+	if (!begin)
+		flush_logic(sdi);
+
+	packet.type = begin ? SR_DF_FRAME_BEGIN : SR_DF_FRAME_END;
+	packet.payload = NULL;
+	session_send(sdi, &packet);
+
+	devc->frame_open = begin;
+}
+
+/*
+ * Reports the completed segment, 'dead_time' is its re-arm time in us.
+ */
+static void send_segment(const struct sr_dev_inst *sdi, int64_t dead_time) {
+	struct dev_context *devc;
+	struct kingst_laxxxx_segment segment;
+	struct sr_datafeed_packet packet;
+
+	devc = sdi->priv;
+
+	segment.segment = devc->num_frames;
+	segment.lost_samples = devc->frame_lost;
+	segment.dead_time = dead_time;
+
+	packet.type = KINGST_LAXXXX_DF_SEGMENT;
+	packet.payload = &segment;
+	session_send(sdi, &packet);
+
+	sr_dbg("Segment %lu: %lu samples lost, re-armed in %ld us.",
+			devc->num_frames, devc->frame_lost, dead_time);
+	devc->frame_lost = 0;
+}
+
+/*
+ * Called when a segment is complete. Returns FALSE when the acquisition
+ * should be stopped.
+ */
+static gboolean next_segment(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	int64_t start, rearm;
+
+	devc = sdi->priv;
+
+	if (!devc->limit_frames) {
+		sr_dbg("next_segment(): samples limit reached %ld",
+				devc->sent_samples);
+		return FALSE;
+	}
+
+	start = g_get_monotonic_time();
+	send_frame(sdi, FALSE);
+	devc->num_frames++;
+	if (devc->num_frames >= devc->limit_frames) {
+		send_segment(sdi, 0);
+		return FALSE;
+	}
+
+	devc->sent_samples = 0;
+	if (devc->stl) {
+		soft_trigger_logic_free(devc->stl);
+		devc->stl = NULL;
+	}
+	if (setup_soft_trigger(sdi) != SR_OK) {
+		sr_err("Failed to re-arm the soft trigger.");
+		send_segment(sdi, 0);
+		return FALSE;
+	}
+
+	rearm = g_get_monotonic_time() - start;
+	devc->rearm_max = MAX(devc->rearm_max, rearm);
+	send_segment(sdi, rearm);
+	send_frame(sdi, TRUE);
+
+	return TRUE;
+}
+
+/*
+ * Convert one block of the sample data, check the soft trigger and send
+ * the samples to the session. Returns FALSE when the acquisition should
+ * be stopped.
+ */
+static gboolean process_sample_block(const struct sr_dev_inst *sdi,
+									const uint8_t *buffer,
+									size_t length) {
+	struct dev_context *devc;
+	size_t num_samples, new_samples;
+	int trigger_offset, pre_trigger_samples;
+	struct sr_datafeed_logic logic;
+	struct sr_datafeed_packet packet;
+	uint8_t *data;
+
+	devc = sdi->priv;
+
+	logic.unitsize = devc->unitsize;
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+
+	/* Frames start before the soft trigger sends pre-trigger samples. */
+	if (devc->limit_frames && !devc->frame_open && !devc->num_frames)
+		send_frame(sdi, TRUE);
+
+	new_samples = kingst_laxxxx_convert_sample_data(devc,
+										devc->convbuffer,
+										devc->convbuffer_size,
+										buffer,
+										length);
+	data = devc->convbuffer;
+
+	while (new_samples) {
+		if (!devc->trigger_fired) {
+			trigger_offset = soft_trigger_logic_check(devc->stl,
+														data,
+														new_samples * devc->unitsize,
+														&pre_trigger_samples);
+			if (trigger_offset < 0)
+				return TRUE;
+
+			devc->sent_samples += pre_trigger_samples;
+			devc->trigger_fired = TRUE;
+			data += trigger_offset * devc->unitsize;
+			new_samples -= trigger_offset;
+		}
+
+		num_samples = new_samples;
+		if (devc->limit_samples
+				&& (num_samples > devc->limit_samples - devc->sent_samples))
+			num_samples = devc->limit_samples - devc->sent_samples;
+		if (num_samples) {
+			logic.length = num_samples * devc->unitsize;
+			logic.data = data;
+			send_logic(sdi, &packet);
+			devc->sent_samples += num_samples;
+			data += num_samples * devc->unitsize;
+			new_samples -= num_samples;
+		}
+
+		if (devc->limit_samples && (devc->sent_samples >= devc->limit_samples)
+				&& !next_segment(sdi))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Account for 'length' bytes of sample data lost before the next block.
+ * The incomplete channel group is dropped and the words up to the next
+ * group boundary are skipped, so the channels stay in place. Bitplanes
+ * carry their offsets and only need the word count. The session sees the
+ * gap as the end of a frame and the begin of the next one, with a
+ * KINGST_LAXXXX_DF_GAP packet between them giving the lost samples.
+ */
+static void skip_sample_data(const struct sr_dev_inst *sdi, uint64_t length) {
+	struct dev_context *devc;
+	struct kingst_laxxxx_gap gap;
+	struct sr_datafeed_packet packet;
+	uint64_t words;
+	unsigned int n;
+
+	devc = sdi->priv;
+	n = devc->num_channels;
+
+	words = length / 2;
+	if (!words)
+		return;
+
+	gap.sample_offset = devc->sent_samples;
+	if (devc->bitplanes) {
+		gap.lost_samples = ((devc->received_words + words) / n
+				- devc->received_words / n) * 16;
+		devc->received_words += words;
+		devc->sent_samples = (devc->received_words / n) * 16;
+	} else {
+		words += devc->cur_channel;
+		devc->skip_words = (n - words % n) % n;
+		gap.lost_samples = ((words + devc->skip_words) / n) * 16;
+		devc->cur_channel = 0;
+		memset(devc->channel_data, 0, sizeof(devc->channel_data));
+	}
+
+	sr_warn("Lost 0x%lx bytes of sample data, %lu samples after sample %lu.",
+			length, gap.lost_samples, gap.sample_offset);
+	devc->frame_lost += gap.lost_samples;
+
+	/* Before the trigger the samples aren't sent, there is no gap. */
+	if (!devc->bitplanes && !devc->trigger_fired)
+		return;
+
+	/* The samples after the gap go to a new frame. */
+	if (devc->frame_open)
+		send_frame(sdi, FALSE);
+	else
+		flush_logic(sdi);
+
+	packet.type = KINGST_LAXXXX_DF_GAP;
+	packet.payload = &gap;
+	session_send(sdi, &packet);
+
+	send_frame(sdi, TRUE);
+}
+
+/* Returns FALSE when the acquisition should be stopped. */
+static gboolean process_sample_data(const struct sr_dev_inst *sdi,
+									const uint8_t *buffer,
+									size_t length) {
+	return kingst_laxxxx_walk_sample_data(sdi, buffer, length,
+			process_sample_block, process_bitplanes);
+}
+
+/*
+ * Check the status of a completed transfer. Returns 1 when its data
+ * should be processed, 0 when it should be skipped and -1 when the
+ * acquisition should be stopped.
+ */
+static int check_transfer(struct dev_context *devc, int status, int length) {
+	gboolean packet_has_error = FALSE;
+
+	switch (status) {
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		sr_err("check_transfer(): no device");
+		return -1;
+	case LIBUSB_TRANSFER_COMPLETED:
+	case LIBUSB_TRANSFER_TIMED_OUT: /* We may have received some data though. */
+		break;
+	default:
+		packet_has_error = TRUE;
+		break;
+	}
+
+	if (length == 0 || packet_has_error) {
+		devc->empty_transfer_count++;
+		if (devc->empty_transfer_count > MAX_EMPTY_TRANSFERS) {
+			sr_err("check_transfer(): MAX_EMPTY_TRANSFERS exceeded");
+			return -1;
+		}
+		if (packet_has_error) {
+			devc->failed_transfers++;
+			devc->failed_bytes += length;
+		}
+		/* The data received before an error is valid. */
+		if (length) {
+			sr_warn("check_transfer(): transfer failed after %d bytes", length);
+			return 1;
+		}
+		sr_err("check_transfer(): skip transfer due error: actual_length %d, has_error %d",
+				length, packet_has_error);
+		return 0;
+	}
+
+	devc->empty_transfer_count = 0;
+
+	return 1;
+}
+
+static void LIBUSB_CALL
+receive_transfer(struct libusb_transfer *transfer) {
+	struct sr_dev_inst *sdi;
+	struct dev_context *devc;
+	int64_t completed;
+
+	sdi = transfer->user_data;
+	devc = sdi->priv;
+	completed = devc->autotune || devc->max_latency ? g_get_monotonic_time() : 0;
+
+	if (devc->pipeline_free)
+		pipeline_poll(sdi);
+
+	/*
+	 * If acquisition has already ended, just free any queued up
+	 * transfer that come in.
+	 */
+	if (devc->acq_aborted) {
+
+		free_transfer(transfer);
+		return;
+	}
+
+	if (devc->record_file)
+		record_transfer(devc, transfer);
+
+	switch (check_transfer(devc, transfer->status, transfer->actual_length)) {
+	case -1:
+		kingst_laxxxx_acquisition_stop(sdi);
+		free_transfer(transfer);
+		return;
+	case 0:
+		resubmit_transfer(transfer);
+		return;
+	}
+
+	if (!devc->first_samples) {
+		devc->first_samples = g_get_monotonic_time();
+		sr_info("First samples %" PRId64 " us after the acquisition start, %"
+				PRId64 " us after the sampling start.",
+				devc->first_samples - devc->start_time,
+				devc->first_samples - devc->sampling_start);
+	}
+
+	if (transfer->actual_length < transfer->length)
+		devc->short_transfers++;
+
+	if (devc->pipeline_free) {
+		pipeline_push(sdi, transfer, completed);
+		return;
+	}
+
+	devc->data_completed = completed;
+	devc->data_length = transfer->actual_length;
+	if (process_sample_data(sdi, transfer->buffer, transfer->actual_length)) {
+		/* Merged packets are measured when they are sent. */
+		if (devc->max_latency && !devc->packet_buffer)
+			latency_update(sdi, completed, transfer->actual_length);
+		if (devc->autotune)
+			autotune_update(sdi, completed);
+		resubmit_transfer(transfer);
+	} else {
+		kingst_laxxxx_acquisition_stop(sdi);
+		free_transfer(transfer);
+	}
+}
+
+/*
+ * Conversion pipeline.
+ *
+ * When SR_CONF_PIPELINE_DEPTH is set, the completed transfer buffer
+ * is queued to the conversion thread and the transfer is resubmitted at
+ * once with a spare buffer from the pool of 'depth' buffers. The thread
+ * runs process_sample_data() in completion order and returns the buffer
+ * to the pool.
+ *
+ * The buffers form a bounded ring. When none is spare, the consumer is
+ * behind and SR_CONF_OVERLOAD_POLICY decides: abort the acquisition with
+ * an error, drop the oldest queued data or drop the new data. Delaying
+ * the resubmission instead would overrun the device FIFO. Every item
+ * carries its offset in the stream, so the consumer sees the dropped
+ * data and sends a gap packet in its place.
+ *
+ * With SR_CONF_USB_THREAD the pipeline hands the data from the USB
+ * thread to the session: without a conversion thread, the session source
+ * runs pipeline_drain().
+ *
+ * The conversion thread sends the packets itself, so the datafeed
+ * callbacks run on it. All the packets of the acquisition go through
+ * session_send(), which serializes them with 'devc->send_mutex'. The
+ * header and the end packets are sent by the session thread while the
+ * conversion thread isn't running.
+ *
+ * Transfers are freed and the acquisition is stopped only from the
+ * libusb event handling thread: the conversion thread requests it with
+ * 'devc->stop_requested' and pipeline_poll() acts upon it.
+ */
+struct pipeline_item {
+	uint8_t *buffer;
+	int length;
+	uint64_t offset;
+	int64_t completed;
+};
+
+static struct pipeline_item pipeline_end_item;
+
+static void pipeline_process(const struct sr_dev_inst *sdi,
+								struct pipeline_item *item) {
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+
+	g_atomic_int_add(&devc->pipeline_queued, -1);
+
+	if (!devc->acq_aborted && !g_atomic_int_get(&devc->stop_requested)) {
+		if (item->offset != devc->pipeline_consumed)
+			skip_sample_data(sdi, item->offset - devc->pipeline_consumed);
+		devc->data_completed = item->completed;
+		devc->data_length = item->length;
+		if (!process_sample_data(sdi, item->buffer, item->length))
+			g_atomic_int_set(&devc->stop_requested, TRUE);
+		else if (devc->max_latency && !devc->packet_buffer)
+			latency_update(sdi, item->completed, item->length);
+	}
+	devc->pipeline_consumed = item->offset + item->length;
+
+	g_async_queue_push(devc->pipeline_free, item);
+}
+
+static gpointer pipeline_worker(gpointer data) {
+	const struct sr_dev_inst *sdi;
+	struct dev_context *devc;
+	struct pipeline_item *item;
+	int64_t timeout;
+
+	sdi = data;
+	devc = sdi->priv;
+
+	for (;;) {
+		/* Wake up to send a merged packet when it gets too old. */
+		if (devc->packet_length && devc->packet_age) {
+			timeout = devc->packet_time + devc->packet_age
+					- g_get_monotonic_time();
+			item = g_async_queue_timeout_pop(devc->pipeline_full,
+					MAX(timeout, 1));
+		} else {
+			item = g_async_queue_pop(devc->pipeline_full);
+		}
+		if (item == &pipeline_end_item)
+			break;
+		if (item)
+			pipeline_process(sdi, item);
+		packet_poll(sdi);
+	}
+
+	return NULL;
+}
+
+/*
+ * Process the queued data without a conversion thread.
+ */
+static void pipeline_drain(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct pipeline_item *item;
+
+	devc = sdi->priv;
+
+	while ((item = g_async_queue_try_pop(devc->pipeline_full)))
+		pipeline_process(sdi, item);
+}
+
+/*
+ * Buffers queued to the consumer, for config_get().
+ */
+unsigned int kingst_laxxxx_pipeline_occupancy(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+
+	return g_atomic_int_get(&devc->pipeline_queued);
+}
+
+static int pipeline_start(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct pipeline_item *item;
+	GError *error = NULL;
+	gboolean worker;
+	unsigned int i;
+	size_t size;
+
+	devc = sdi->priv;
+
+	devc->pipeline_thread = NULL;
+	devc->pipeline_depth = devc->tunables.pipeline_depth;
+	devc->pipeline_offset = 0;
+	devc->pipeline_consumed = 0;
+	devc->pipeline_max_queued = 0;
+	g_atomic_int_set(&devc->pipeline_queued, 0);
+	devc->pipeline_overflows = 0;
+	devc->pipeline_dropped_bytes = 0;
+	devc->stop_requested = FALSE;
+
+	devc->overload = devc->tunables.overload;
+
+	worker = devc->pipeline_depth != 0;
+	/* The USB thread queues as much data as the transfers hold. */
+	if (!worker && devc->use_usb_thread)
+		devc->pipeline_depth = get_number_of_transfers(devc);
+	if (!devc->pipeline_depth)
+		return SR_OK;
+
+	devc->pipeline_free = g_async_queue_new();
+	devc->pipeline_full = g_async_queue_new();
+
+	for (i = 0; i < devc->pipeline_depth; i++) {
+		item = g_try_new0(struct pipeline_item, 1);
+		if (!item || !(item->buffer = pool_get_buffer(sdi))) {
+			g_free(item);
+			sr_err("Pipeline buffer malloc failed.");
+			pipeline_stop(sdi);
+			return SR_ERR_MALLOC;
+		}
+		g_async_queue_push(devc->pipeline_free, item);
+	}
+
+	size = devc->transfer_size;
+	if (!worker) {
+		sr_info("USB thread queue started: depth %d, buffer size 0x%lx",
+				devc->pipeline_depth, size);
+		return SR_OK;
+	}
+
+	devc->pipeline_thread = g_thread_try_new("kingst-laxxxx-pipeline",
+												pipeline_worker, (gpointer) sdi, &error);
+	if (!devc->pipeline_thread) {
+		sr_err("Failed to start conversion thread: %s.", error->message);
+		g_error_free(error);
+		pipeline_stop(sdi);
+		return SR_ERR;
+	}
+
+	sr_info("Conversion pipeline started: depth %d, buffer size 0x%lx",
+			devc->pipeline_depth, size);
+
+	return SR_OK;
+}
+
+/*
+ * Process the queued data, by the conversion thread when there is one,
+ * and free the pipeline.
+ */
+static void pipeline_stop(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct pipeline_item *item;
+
+	devc = sdi->priv;
+
+	if (!devc->pipeline_free)
+		return;
+
+	if (devc->pipeline_thread) {
+		g_async_queue_push(devc->pipeline_full, &pipeline_end_item);
+		g_thread_join(devc->pipeline_thread);
+		devc->pipeline_thread = NULL;
+	} else {
+		/* The last data the USB thread queued. */
+		pipeline_drain(sdi);
+	}
+
+	/* Nothing should be left, but don't leak the buffers if it is. */
+	while ((item = g_async_queue_try_pop(devc->pipeline_full)))
+		g_async_queue_push(devc->pipeline_free, item);
+
+	sr_info("Sample ring: depth %d, high-water %d (0x%lx bytes)",
+			devc->pipeline_depth, devc->pipeline_max_queued,
+			devc->pipeline_max_queued * devc->transfer_size);
+	if (devc->pipeline_overflows)
+		sr_warn("Sample ring: %d overflows, 0x%lx bytes dropped",
+				devc->pipeline_overflows, devc->pipeline_dropped_bytes);
+
+	while ((item = g_async_queue_try_pop(devc->pipeline_free))) {
+		pool_put_buffer(devc, item->buffer);
+		g_free(item);
+	}
+
+	g_async_queue_unref(devc->pipeline_free);
+	g_async_queue_unref(devc->pipeline_full);
+	devc->pipeline_free = NULL;
+	devc->pipeline_full = NULL;
+}
+
+/*
+ * Act upon the requests of the conversion thread.
+ */
+static void pipeline_poll(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+
+	if (g_atomic_int_get(&devc->stop_requested) && !devc->acq_aborted)
+		kingst_laxxxx_acquisition_stop(sdi);
+}
+
+/*
+ * Apply the overload policy to a transfer finding the ring full. Returns
+ * the item to queue its data in, or NULL when the transfer was handled.
+ */
+static struct pipeline_item* pipeline_overload(const struct sr_dev_inst *sdi,
+												struct libusb_transfer *transfer) {
+	struct dev_context *devc;
+	struct pipeline_item *item;
+
+	devc = sdi->priv;
+
+	devc->pipeline_overflows++;
+	if (devc->overload == OVERLOAD_ABORT) {
+		sr_err("Sample ring overflow: the session is %d buffers behind, "
+				"aborting the acquisition.", devc->pipeline_depth);
+		kingst_laxxxx_acquisition_stop(sdi);
+		free_transfer(transfer);
+		return NULL;
+	}
+
+	if (devc->pipeline_overflows == 1)
+		sr_warn("Sample ring overflow: the session can't keep up, dropping %s data.",
+				devc->overload == OVERLOAD_DROP_OLDEST ? "the oldest" : "new");
+
+	if (devc->overload == OVERLOAD_DROP_OLDEST
+			&& (item = g_async_queue_try_pop(devc->pipeline_full))) {
+		g_atomic_int_add(&devc->pipeline_queued, -1);
+		devc->pipeline_dropped_bytes += item->length;
+		return item;
+	}
+
+	/* Also when the consumer holds all the buffers. */
+	devc->pipeline_dropped_bytes += transfer->actual_length;
+	resubmit_transfer(transfer);
+
+	return NULL;
+}
+
+static void pipeline_push(const struct sr_dev_inst *sdi,
+							struct libusb_transfer *transfer,
+							int64_t completed) {
+	struct dev_context *devc;
+	struct pipeline_item *item;
+	unsigned int queued;
+	uint64_t offset;
+	uint8_t *buffer;
+
+	devc = sdi->priv;
+
+	offset = devc->pipeline_offset;
+	devc->pipeline_offset += transfer->actual_length;
+
+	item = g_async_queue_try_pop(devc->pipeline_free);
+	if (!item && !(item = pipeline_overload(sdi, transfer)))
+		return;
+
+	buffer = item->buffer;
+	item->buffer = transfer->buffer;
+	item->length = transfer->actual_length;
+	item->offset = offset;
+	item->completed = completed;
+	transfer->buffer = buffer;
+
+	g_async_queue_push(devc->pipeline_full, item);
+	g_atomic_int_inc(&devc->pipeline_queued);
+
+	queued = g_async_queue_length(devc->pipeline_full);
+	if (queued > devc->pipeline_max_queued)
+		devc->pipeline_max_queued = queued;
+
+	resubmit_transfer(transfer);
+}
+
+/*
+ * Raw bulk stream recording and replay.
+ *
+ * With KINGST_LAXXXX_RECORD set every completed bulk transfer is written
+ * to the file together with its status and arrival time, after a header
+ * describing the acquisition. A virtual device created for the file set
+ * in KINGST_LAXXXX_REPLAY feeds the records through the same conversion,
+ * trigger and session code, at full speed or at the recorded pace.
+ */
+
+static int record_start(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct sr_trigger *trigger;
+	struct sr_trigger_stage *stage;
+	struct sr_trigger_match *match;
+	uint8_t header[RAW_FILE_HEADER_SIZE], data[RAW_FILE_MATCH_SIZE];
+	const GSList *l, *m;
+	const char *path;
+	int num_matches;
+
+	devc = sdi->priv;
+	devc->record_file = NULL;
+
+	path = g_getenv(RECORD_FILE_ENV);
+	if (!path || !*path || devc->replay_file)
+		return SR_OK;
+
+	if (!(devc->record_file = fopen(path, "wb"))) {
+		sr_err("Failed to open record file '%s': %s.", path, g_strerror(errno));
+		return SR_ERR;
+	}
+
+	trigger = get_trigger(sdi);
+
+	num_matches = 0;
+	for (l = trigger ? trigger->stages : NULL; l; l = l->next) {
+		stage = l->data;
+		num_matches += g_slist_length(stage->matches);
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, RAW_FILE_MAGIC, 8);
+	WL16(header + 8, devc->cur_channels);
+	WL16(header + 10, num_matches);
+	WL64(header + 16, devc->cur_samplerate);
+	WL64(header + 24, devc->limit_samples);
+	WL64(header + 32, devc->capture_ratio);
+	fwrite(header, sizeof(header), 1, devc->record_file);
+
+	for (l = trigger ? trigger->stages : NULL; l; l = l->next) {
+		stage = l->data;
+		for (m = stage->matches; m; m = m->next) {
+			match = m->data;
+			data[0] = stage->stage;
+			data[1] = match->channel->index;
+			data[2] = match->match;
+			data[3] = 0;
+			fwrite(data, sizeof(data), 1, devc->record_file);
+		}
+	}
+
+	devc->record_start = g_get_monotonic_time();
+
+	sr_info("Recording bulk transfers to '%s'.", path);
+
+	return SR_OK;
+}
+
+static void record_transfer(struct dev_context *devc,
+							const struct libusb_transfer *transfer) {
+	uint8_t header[RAW_FILE_RECORD_SIZE];
+
+	WL32(header, transfer->actual_length);
+	WL32(header + 4, transfer->status);
+	WL64(header + 8, g_get_monotonic_time() - devc->record_start);
+
+	if (fwrite(header, sizeof(header), 1, devc->record_file) != 1
+			|| (transfer->actual_length > 0
+					&& fwrite(transfer->buffer, transfer->actual_length, 1,
+							devc->record_file) != 1)) {
+		sr_err("Failed to write record file, recording stopped.");
+		record_stop(devc);
+	}
+}
+
+static void record_stop(struct dev_context *devc) {
+	if (!devc->record_file)
+		return;
+
+	fclose(devc->record_file);
+	devc->record_file = NULL;
+}
+
+/*
+ * Open the replayed file and set up the acquisition as it was recorded:
+ * the enabled channels, samplerate, limit, capture ratio and trigger.
+ */
+static int replay_open(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct sr_trigger_stage *stage;
+	struct sr_channel *ch;
+	uint8_t header[RAW_FILE_HEADER_SIZE], data[RAW_FILE_MATCH_SIZE];
+	const GSList *l;
+	uint16_t channels;
+	int i, num_matches;
+
+	devc = sdi->priv;
+
+	if (!(devc->replay_file = fopen(devc->replay_path, "rb"))) {
+		sr_err("Failed to open replay file '%s': %s.", devc->replay_path,
+				g_strerror(errno));
+		return SR_ERR;
+	}
+
+	if (fread(header, sizeof(header), 1, devc->replay_file) != 1
+			|| memcmp(header, RAW_FILE_MAGIC, 8)) {
+		sr_err("'%s' isn't a raw bulk stream file.", devc->replay_path);
+		replay_close(devc);
+		return SR_ERR;
+	}
+
+	channels = RL16(header + 8);
+	num_matches = RL16(header + 10);
+	devc->cur_samplerate = RL64(header + 16);
+	devc->limit_samples = RL64(header + 24);
+	devc->capture_ratio = RL64(header + 32);
+
+	for (l = sdi->channels; l; l = l->next) {
+		ch = l->data;
+		ch->enabled = (channels >> ch->index) & 1;
+	}
+
+	stage = NULL;
+	for (i = 0; i < num_matches; i++) {
+		if (fread(data, sizeof(data), 1, devc->replay_file) != 1
+				|| !(ch = g_slist_nth_data(sdi->channels, data[1]))) {
+			sr_err("Wrong trigger in '%s'.", devc->replay_path);
+			replay_close(devc);
+			return SR_ERR;
+		}
+		if (!devc->replay_trigger)
+			devc->replay_trigger = sr_trigger_new(NULL);
+		if (!stage || stage->stage != data[0])
+			stage = sr_trigger_stage_add(devc->replay_trigger);
+		sr_trigger_match_add(stage, ch, data[2], 0);
+	}
+
+	devc->replay_realtime = get_env_uint(REPLAY_REALTIME_ENV, 0) != 0;
+	devc->replay_pending = FALSE;
+
+	sr_info("Replaying '%s': channels %04X, samplerate %" PRIu64 ", limit %" PRIu64 ".",
+			devc->replay_path, channels, devc->cur_samplerate,
+			devc->limit_samples);
+
+	return SR_OK;
+}
+
+static int replay_start(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	int ret;
+
+	devc = sdi->priv;
+
+	devc->sent_samples = 0;
+
+	if ((ret = setup_soft_trigger(sdi)) != SR_OK) {
+		finish_acquisition(sdi);
+		return ret;
+	}
+
+	devc->replay_start = g_get_monotonic_time();
+
+	std_session_send_df_header(sdi);
+
+	return SR_OK;
+}
+
+static void replay_close(struct dev_context *devc) {
+	if (devc->replay_file) {
+		fclose(devc->replay_file);
+		devc->replay_file = NULL;
+	}
+
+	if (devc->replay_trigger) {
+		sr_trigger_free(devc->replay_trigger);
+		devc->replay_trigger = NULL;
+	}
+
+	g_free(devc->replay_buffer);
+	devc->replay_buffer = NULL;
+	devc->replay_buffer_size = 0;
+}
+
+/*
+ * Feed the next recorded transfer through the same path as
+ * receive_transfer(). Returns 1 when it was processed, 0 when it isn't
+ * due yet and -1 when the replay is over.
+ */
+static int replay_transfer(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	uint8_t header[RAW_FILE_RECORD_SIZE];
+
+	devc = sdi->priv;
+
+	if (!devc->replay_pending) {
+		if (fread(header, sizeof(header), 1, devc->replay_file) != 1) {
+			sr_info("Replay of '%s' finished.", devc->replay_path);
+			return -1;
+		}
+		devc->replay_length = RL32(header);
+		devc->replay_status = RL32(header + 4);
+		devc->replay_time = RL64(header + 8);
+		devc->replay_pending = TRUE;
+	}
+
+	if (devc->replay_realtime
+			&& (uint64_t) (g_get_monotonic_time() - devc->replay_start)
+					< devc->replay_time)
+		return 0;
+
+	devc->replay_pending = FALSE;
+
+	if (devc->replay_length > devc->replay_buffer_size) {
+		g_free(devc->replay_buffer);
+		devc->replay_buffer = g_try_malloc(devc->replay_length);
+		if (!devc->replay_buffer) {
+			sr_err("Replay buffer malloc failed.");
+			devc->replay_buffer_size = 0;
+			return -1;
+		}
+		devc->replay_buffer_size = devc->replay_length;
+	}
+
+	if (devc->replay_length
+			&& fread(devc->replay_buffer, devc->replay_length, 1,
+					devc->replay_file) != 1) {
+		sr_err("Truncated record in '%s'.", devc->replay_path);
+		return -1;
+	}
+
+	switch (check_transfer(devc, devc->replay_status, devc->replay_length)) {
+	case -1:
+		return -1;
+	case 0:
+		return 1;
+	}
+
+	if (!process_sample_data(sdi, devc->replay_buffer, devc->replay_length))
+		return -1;
+
+	return 1;
+}
+
+/*
+ * Session source of the replay. At full speed one transfer is replayed
+ * per call, in real time everything that is due.
+ */
+static int replay_receive_data(int fd, int revents, void *cb_data) {
+	const struct sr_dev_inst *sdi;
+	struct dev_context *devc;
+	int ret;
+
+	(void) fd;
+	(void) revents;
+
+	sdi = cb_data;
+	devc = sdi->priv;
+
+	while (!devc->acq_aborted) {
+		if ((ret = replay_transfer(sdi)) < 0)
+			devc->acq_aborted = TRUE;
+		if (ret <= 0 || !devc->replay_realtime)
+			break;
+	}
+
+	packet_poll(sdi);
+
+	if (devc->acq_aborted)
+		finish_acquisition(sdi);
+
+	return TRUE;
+}
+
+int kingst_laxxxx_configure_channels(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	const GSList *l;
+	struct sr_channel *ch;
+	uint16_t channel_bit;
+
+	devc = sdi->priv;
+	devc->num_channels = 0;
+	devc->cur_channels = 0;
+	for (l = sdi->channels; l; l = l->next) {
 		ch = (struct sr_channel*) l->data;
 		if (ch->enabled == FALSE)
 			continue;
 
-		channel_bit = 1 << (ch->index);
-		devc->cur_channels |= channel_bit;
-		devc->channel_masks[devc->num_channels++] = channel_bit;
+		channel_bit = 1 << (ch->index);
+		devc->cur_channels |= channel_bit;
+		devc->channel_masks[devc->num_channels++] = channel_bit;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Sends a packet of the acquisition, see the conversion pipeline.
+ */
+static void session_send(const struct sr_dev_inst *sdi,
+							const struct sr_datafeed_packet *packet) {
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+
+	g_mutex_lock(&devc->send_mutex);
+	sr_session_send(sdi, packet);
+	g_mutex_unlock(&devc->send_mutex);
+}
+
+/*
+ * Returns value of the driver tuning environment variable or 'def' if
+ * it isn't set.
+ */
+static uint64_t get_env_uint(const char *name, uint64_t def) {
+	const char *value;
+	char *end;
+	uint64_t res;
+
+	value = g_getenv(name);
+	if (!value || !*value)
+		return def;
+
+	res = g_ascii_strtoull(value, &end, 0);
+	if (*end) {
+		sr_warn("Wrong value of %s: '%s', using %" PRIu64 ".", name, value, def);
+		return def;
+	}
+
+	return res;
+}
+
+static unsigned int to_bytes_per_ms(unsigned int samplerate, uint8_t num_channels) {
+	unsigned long result = samplerate * num_channels / 8;
+	return result / 1000;
+}
+
+SR_PRIV size_t kingst_laxxxx_get_buffer_size(struct dev_context *devc) {
+	size_t s;
+
+	if ((s = devc->tunables.transfer_size))
+		return MAX((s + 511) & ~511, 512);
+
+	/*
+	 * This transfer size used by KingstVIS
+	 */
+	s = devc->num_channels * devc->cur_samplerate / 128;
+
+	/*
+	 * With a latency bound a transfer fills within half of it. The
+	 * device sends whole packets, so one packet is the least.
+	 */
+	if (devc->max_latency)
+		s = MAX((devc->num_channels * devc->cur_samplerate / 8
+				* devc->max_latency / 2000000) & ~511, 512);
+
+	/* Leave room for two transfers within the buffer size limit. */
+	if (devc->buffer_size && s > devc->buffer_size / 2)
+		return MAX((devc->buffer_size / 2) & ~511, 512);
+
+	return (s + 511) & ~511;
+}
+
+static unsigned int get_number_of_transfers(struct dev_context *devc) {
+	unsigned int n;
+	size_t size;
+
+	if ((n = devc->tunables.num_transfers))
+		return n;
+
+	/* Total buffer size should be able to hold about 500ms of data. */
+	size = kingst_laxxxx_get_buffer_size(devc);
+	n = (500 * to_bytes_per_ms(devc->cur_samplerate, devc->num_channels))
+			/ size;
+
+	if (devc->buffer_size && n * size > devc->buffer_size)
+		n = devc->buffer_size / size;
+
+	/* Small transfers would make too many of them. */
+	if (devc->max_latency)
+		n = MIN(n, LATENCY_MAX_TRANSFERS);
+
+	return MAX(n, 1);
+}
+
+static unsigned int get_timeout(struct dev_context *devc) {
+	return get_transfers_timeout(devc, kingst_laxxxx_get_buffer_size(devc),
+			get_number_of_transfers(devc));
+}
+
+static unsigned int get_transfers_timeout(struct dev_context *devc,
+											size_t size,
+											unsigned int num_transfers) {
+	unsigned int timeout;
+
+	timeout = size * num_transfers
+			/ MAX(to_bytes_per_ms(devc->cur_samplerate, devc->num_channels), 1);
+	return timeout + timeout / 4; /* Leave a headroom of 25% percent. */
+}
+
+/*
+ * Low latency mode.
+ *
+ * SR_CONF_MAX_LATENCY bounds the age of the samples when they
+ * reach the session: the transfers are sized to fill within half of the
+ * bound. The age of the oldest sample of every transfer is measured after
+ * sending it, from the completion time and the time its data took to
+ * arrive, and reported with a KINGST_LAXXXX_DF_LATENCY packet every
+ * LATENCY_REPORT_US.
+ */
+static void latency_start(struct dev_context *devc) {
+	uint64_t packet_us;
+
+	devc->max_latency = devc->tunables.max_latency * 1000;
+	devc->latency_report = 0;
+	devc->latency_max = 0;
+	devc->latency_sum = 0;
+	devc->latency_count = 0;
+	devc->latency_peak = 0;
+	if (!devc->max_latency)
+		return;
+
+	packet_us = 512 * 8 * 1000000ULL
+			/ MAX(devc->cur_samplerate * devc->num_channels, 1);
+	if (packet_us > devc->max_latency)
+		sr_warn("A 512 byte packet takes %lu us at this samplerate, above "
+				"the latency bound of %lu us.", packet_us, devc->max_latency);
+
+	sr_info("Latency bound %lu us.", devc->max_latency);
+}
+
+static void latency_send(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct kingst_laxxxx_latency latency;
+	struct sr_datafeed_packet packet;
+
+	devc = sdi->priv;
+
+	if (!devc->latency_count)
+		return;
+
+	latency.bound = devc->max_latency;
+	latency.max = devc->latency_max;
+	latency.average = devc->latency_sum / devc->latency_count;
+
+	packet.type = KINGST_LAXXXX_DF_LATENCY;
+	packet.payload = &latency;
+	session_send(sdi, &packet);
+
+	sr_dbg("Latency: max %lu us, average %lu us", latency.max,
+			latency.average);
+
+	devc->latency_max = 0;
+	devc->latency_sum = 0;
+	devc->latency_count = 0;
+}
+
+static void latency_update(const struct sr_dev_inst *sdi,
+							int64_t completed,
+							size_t length) {
+	struct dev_context *devc;
+	uint64_t age;
+	int64_t now;
+
+	devc = sdi->priv;
+
+	now = g_get_monotonic_time();
+	age = now - completed + length * 8 * 1000000ULL
+			/ MAX(devc->cur_samplerate * devc->num_channels, 1);
+
+	devc->latency_max = MAX(devc->latency_max, age);
+	devc->latency_peak = MAX(devc->latency_peak, age);
+	devc->latency_sum += age;
+	devc->latency_count++;
+
+	if (!devc->latency_report)
+		devc->latency_report = now + LATENCY_REPORT_US;
+	if (now >= devc->latency_report) {
+		latency_send(sdi);
+		devc->latency_report = now + LATENCY_REPORT_US;
+	}
+}
+
+static void latency_stop(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+
+	if (!devc->max_latency)
+		return;
+
+	latency_send(sdi);
+
+	if (devc->latency_peak > devc->max_latency)
+		sr_warn("Latency peaked at %lu us, above the bound of %lu us.",
+				devc->latency_peak, devc->max_latency);
+	else
+		sr_info("Latency peaked at %lu us.", devc->latency_peak);
+}
+
+/*
+ * USB thread.
+ *
+ * With SR_CONF_USB_THREAD set, the libusb events are handled on a
+ * dedicated thread, optionally pinned to KINGST_LAXXXX_USB_THREAD_CPU and
+ * scheduled SCHED_FIFO with KINGST_LAXXXX_USB_THREAD_PRIORITY. It only
+ * resubmits the transfers and queues their data through the pipeline; the
+ * session thread delivers it. Once the last transfer is freed, the
+ * session thread joins the USB thread and finishes the acquisition.
+ */
+static void usb_thread_setup(void) {
+	uint64_t cpu, priority;
+#ifdef G_OS_UNIX
+	struct sched_param param;
+	int ret;
+#endif
+#ifdef __linux__
+	cpu_set_t set;
+#endif
+
+	cpu = get_env_uint(USB_THREAD_CPU_ENV, G_MAXUINT64);
+	if (cpu != G_MAXUINT64) {
+#ifdef __linux__
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (cpu >= CPU_SETSIZE || sched_setaffinity(0, sizeof(set), &set))
+			sr_warn("Failed to pin USB thread to CPU %lu: %s.", cpu,
+					g_strerror(errno));
+#else
+		sr_warn("USB thread CPU affinity is not supported.");
+#endif
+	}
+
+	priority = get_env_uint(USB_THREAD_PRIORITY_ENV, 0);
+	if (priority) {
+#ifdef G_OS_UNIX
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = priority;
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (ret)
+			sr_warn("Failed to set USB thread SCHED_FIFO priority %lu: %s.",
+					priority, g_strerror(ret));
+#else
+		sr_warn("USB thread priority is not supported.");
+#endif
+	}
+}
+
+static gpointer usb_thread_run(gpointer data) {
+	const struct sr_dev_inst *sdi;
+	struct dev_context *devc;
+	struct sr_usb_dev_inst *usb;
+	const struct kingst_laxxxx_usb_ops *usb_ops;
+	struct timeval tv;
+
+	sdi = data;
+	devc = sdi->priv;
+	usb = sdi->conn;
+	usb_ops = kingst_laxxxx_usb_ops(usb->devhdl);
+	devc->usb_thread = g_thread_self();
+
+	usb_thread_setup();
+
+	while (!g_atomic_int_get(&devc->usb_thread_done)) {
+		pipeline_poll(sdi);
+
+		tv.tv_sec = 0;
+		tv.tv_usec = USB_THREAD_EVENTS_TIMEOUT_MS * 1000;
+		usb_ops->handle_events(devc->ctx->libusb_ctx, &tv,
+				&devc->usb_thread_done);
+	}
+
+	return NULL;
+}
+
+/*
+ * Without the thread the session source keeps handling the events.
+ */
+static int usb_thread_start(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	GError *error = NULL;
+	GThread *thread;
+
+	devc = sdi->priv;
+
+	thread = g_thread_try_new("kingst-laxxxx-usb", usb_thread_run,
+								(gpointer) sdi, &error);
+	if (!thread) {
+		sr_warn("Failed to start USB thread: %s.", error->message);
+		g_error_free(error);
+		return SR_ERR;
+	}
+	devc->usb_thread = thread;
+
+	sr_info("USB events are handled on a dedicated thread.");
+
+	return SR_OK;
+}
+
+static void usb_thread_finish(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+
+	g_thread_join(devc->usb_thread);
+	devc->usb_thread = NULL;
+
+	finish_acquisition(sdi);
+}
+
+/*
+ * Transfer autotuning.
+ *
+ * With SR_CONF_AUTOTUNE set, the gaps between the completions and
+ * the time spent in the callback are measured over windows of
+ * AUTOTUNE_COMPLETIONS transfers. After the first window the transfers
+ * are shortened to the lowest latency the callback time allows, and
+ * their number is set to cover twice the worst completion jitter. Later
+ * windows only add transfers when the jitter grows. The computed size,
+ * the SR_CONF_BUFFERSIZE limit and AUTOTUNE_MAX_TRANSFERS are never
+ * exceeded. Transfers are resized and retired when they are resubmitted.
+ */
+static void autotune_start(struct dev_context *devc) {
+	devc->autotune = FALSE;
+	if (!devc->tunables.autotune)
+		return;
+
+	if (devc->pipeline_free || devc->max_latency
+			|| devc->tunables.transfer_size
+			|| devc->tunables.num_transfers) {
+		sr_info("No transfer autotuning with pinned transfers, latency bound or conversion pipeline.");
+		return;
+	}
+
+	devc->autotune = TRUE;
+	devc->autotune_window = 0;
+	devc->autotune_completions = 0;
+	devc->autotune_skip = 0;
+	devc->autotune_last = 0;
+	devc->autotune_max_gap = 0;
+	devc->autotune_max_busy = 0;
+}
+
+/* Submits new transfers up to the target number. */
+static void autotune_add_transfers(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct libusb_transfer *transfer;
+	unsigned int i;
+
+	devc = sdi->priv;
+
+	while ((unsigned int) devc->submitted_transfers < devc->target_transfers) {
+		for (i = 0; i < devc->max_transfers && devc->transfers[i]; i++);
+		if (i == devc->max_transfers)
+			break;
+
+		transfer = pool_get_transfer(sdi, devc->transfer_size,
+				devc->transfer_timeout);
+		if (!transfer)
+			break;
+		if (submit_transfer(transfer) != LIBUSB_SUCCESS) {
+			pool_put_transfer(devc, transfer);
+			break;
+		}
+
+		devc->transfers[i] = transfer;
+		if (i >= devc->num_transfers)
+			devc->num_transfers = i + 1;
+		devc->submitted_transfers++;
+	}
+}
+
+static void autotune_retune(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	unsigned int bytes_per_ms, n;
+	int64_t period, new_period, jitter;
+	size_t size;
+
+	devc = sdi->priv;
+
+	bytes_per_ms = to_bytes_per_ms(devc->cur_samplerate, devc->num_channels);
+	size = devc->transfer_size;
+	period = (int64_t) size * 1000 / bytes_per_ms;
+	jitter = MAX(devc->autotune_max_gap - period, 0);
+
+	if (devc->autotune_window == 0) {
+		/* As short as possible, but long enough to amortize the callback. */
+		new_period = MAX(AUTOTUNE_BUSY_RATIO * devc->autotune_max_busy,
+				AUTOTUNE_MIN_PERIOD_US);
+		if (new_period < period) {
+			size = (new_period * bytes_per_ms / 1000 + 511) & ~511;
+			size = MIN(size, devc->transfer_size);
+			period = (int64_t) size * 1000 / bytes_per_ms;
+		}
 	}
 
-	return SR_OK;
-}
+	/* Ride out twice the worst jitter plus the callback of one transfer. */
+	n = (2 * jitter + devc->autotune_max_busy) / MAX(period, 1) + 2;
+	n = MAX(n, AUTOTUNE_MIN_TRANSFERS);
+	n = MIN(n, devc->max_transfers);
+	if (devc->buffer_size)
+		n = MIN(n, MAX(devc->buffer_size / size, 1));
+	if (devc->autotune_window > 0)
+		n = MAX(n, devc->target_transfers);
+
+	if (size != devc->transfer_size || n != devc->target_transfers) {
+		sr_info("Autotuned transfers: %u x %zu bytes, jitter %" PRIi64
+				" us, callback %" PRIi64 " us.", n, size, jitter,
+				devc->autotune_max_busy);
+		/* Don't measure until the old transfers are back. */
+		devc->autotune_skip = devc->submitted_transfers;
+	}
 
-static unsigned int to_bytes_per_ms(unsigned int samplerate, uint8_t num_channels) {
-	unsigned long result = samplerate * num_channels / 8;
-	return result / 1000;
+	devc->transfer_size = size;
+	devc->target_transfers = n;
+	devc->transfer_timeout = get_transfers_timeout(devc, size, n);
+	devc->autotune_window++;
+
+	autotune_add_transfers(sdi);
 }
 
-static size_t get_buffer_size(struct dev_context *devc) {
-	size_t s;
+/*
+ * Accounts a processed transfer that completed at 'completed'.
+ */
+static void autotune_update(const struct sr_dev_inst *sdi, int64_t completed) {
+	struct dev_context *devc;
+	int64_t now;
 
-	/*
-	 * This transfer size used by KingstVIS
-	 */
-	s = devc->num_channels * devc->cur_samplerate / 128;
-	return (s + 511) & ~511;
+	devc = sdi->priv;
+	now = g_get_monotonic_time();
+
+	if (devc->autotune_skip) {
+		devc->autotune_skip--;
+		devc->autotune_last = completed;
+		return;
+	}
+
+	if (devc->autotune_last)
+		devc->autotune_max_gap = MAX(devc->autotune_max_gap,
+				completed - devc->autotune_last);
+	devc->autotune_last = completed;
+	devc->autotune_max_busy = MAX(devc->autotune_max_busy, now - completed);
+
+	if (++devc->autotune_completions < AUTOTUNE_COMPLETIONS)
+		return;
+
+	autotune_retune(sdi);
+
+	devc->autotune_completions = 0;
+	devc->autotune_max_gap = 0;
+	devc->autotune_max_busy = 0;
 }
 
-static unsigned int get_number_of_transfers(struct dev_context *devc) {
-	unsigned int n;
+/*
+ * Brings a transfer to be resubmitted to the tuned size. Returns FALSE
+ * when there are more transfers than needed and it should be freed.
+ */
+static gboolean autotune_transfer(const struct sr_dev_inst *sdi,
+									struct libusb_transfer *transfer) {
+	struct dev_context *devc;
 
-	/* Total buffer size should be able to hold about 500ms of data. */
-	n = (500 * to_bytes_per_ms(devc->cur_samplerate, devc->num_channels))
-			/ get_buffer_size(devc);
+	devc = sdi->priv;
 
-//	if (n > NUM_SIMUL_TRANSFERS)
-//		return NUM_SIMUL_TRANSFERS;
+	if ((unsigned int) devc->submitted_transfers > devc->target_transfers)
+		return FALSE;
 
-	return n;
+	/* Tuned transfers are never larger than the pool buffers. */
+	transfer->length = MIN(devc->transfer_size, devc->pool_buffer_size);
+	transfer->timeout = devc->transfer_timeout;
+
+	return TRUE;
 }
 
-static unsigned int get_timeout(struct dev_context *devc) {
-	size_t total_size;
-	unsigned int timeout;
+/*
+ * Transfer pool.
+ *
+ * Transfers and their buffers are kept across acquisitions and freed on
+ * close, so repeated captures don't allocate and fault in new buffers.
+ * All buffers of a device have the same size: they are swapped between
+ * transfers by the conversion pipeline. They are allocated with
+ * libusb_dev_mem_alloc() when usbfs supports it, so the kernel fills
+ * them without a bounce buffer, and otherwise page-aligned and, with
+ * KINGST_LAXXXX_MLOCK set, locked in RAM.
+ */
+static uint8_t* pool_alloc_buffer(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct sr_usb_dev_inst *usb;
+	uint8_t *buffer;
+	size_t size;
+#ifdef G_OS_UNIX
+	void *mem;
+#endif
 
-	total_size = get_buffer_size(devc) * get_number_of_transfers(devc);
-	timeout = total_size
-			/ to_bytes_per_ms(devc->cur_samplerate, devc->num_channels);
-	return timeout + timeout / 4; /* Leave a headroom of 25% percent. */
+	devc = sdi->priv;
+	usb = sdi->conn;
+	size = devc->pool_buffer_size;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (!devc->dev_mem_failed) {
+		if ((buffer = libusb_dev_mem_alloc(usb->devhdl, size))) {
+			if (!devc->dev_mem_buffers)
+				devc->dev_mem_buffers = g_hash_table_new(g_direct_hash,
+						g_direct_equal);
+			g_hash_table_add(devc->dev_mem_buffers, buffer);
+			return buffer;
+		}
+		sr_info("No usbfs transfer memory, using page-aligned buffers.");
+		devc->dev_mem_failed = TRUE;
+	}
+#else
+	(void) usb;
+#endif
+
+#ifdef G_OS_UNIX
+	if (posix_memalign(&mem, sysconf(_SC_PAGESIZE), size))
+		return NULL;
+	buffer = mem;
+	if (get_env_uint(MLOCK_ENV, 0) && mlock(buffer, size))
+		sr_warn("Failed to lock transfer buffer: %s.", g_strerror(errno));
+#else
+	buffer = g_try_malloc(size);
+#endif
+
+	return buffer;
 }
 
-static int start_transfers(const struct sr_dev_inst *sdi) {
+static void pool_free_buffer(const struct sr_dev_inst *sdi, uint8_t *buffer) {
 	struct dev_context *devc;
 	struct sr_usb_dev_inst *usb;
-	struct sr_trigger *trigger;
+
+	devc = sdi->priv;
+	usb = sdi->conn;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (devc->dev_mem_buffers
+			&& g_hash_table_remove(devc->dev_mem_buffers, buffer)) {
+		libusb_dev_mem_free(usb->devhdl, buffer, devc->pool_buffer_size);
+		return;
+	}
+#else
+	(void) usb;
+#endif
+
+#ifdef G_OS_UNIX
+	munlock(buffer, devc->pool_buffer_size);
+	free(buffer);
+#else
+	g_free(buffer);
+#endif
+}
+
+/*
+ * Frees the idle transfers and buffers. All transfers must be idle.
+ */
+void kingst_laxxxx_free_transfers(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
 	struct libusb_transfer *transfer;
-	unsigned int i, num_transfers;
-	int timeout, ret;
-	int pre_trigger_samples;
-	unsigned char *buf;
-	size_t size;
+	GSList *l;
 
-	sr_dbg("start_transfers():");
+	devc = sdi->priv;
+
+	for (l = devc->idle_transfers; l; l = l->next) {
+		transfer = l->data;
+		pool_free_buffer(sdi, transfer->buffer);
+		libusb_free_transfer(transfer);
+	}
+	g_slist_free(devc->idle_transfers);
+	devc->idle_transfers = NULL;
+
+	for (l = devc->idle_buffers; l; l = l->next)
+		pool_free_buffer(sdi, l->data);
+	g_slist_free(devc->idle_buffers);
+	devc->idle_buffers = NULL;
+
+	if (devc->dev_mem_buffers) {
+		g_hash_table_destroy(devc->dev_mem_buffers);
+		devc->dev_mem_buffers = NULL;
+	}
+	devc->pool_buffer_size = 0;
+}
+
+/*
+ * Makes the pool buffers hold 'size' bytes. The pool is reallocated when
+ * they are too small or more than twice as large.
+ */
+static void pool_reserve(const struct sr_dev_inst *sdi, size_t size) {
+	struct dev_context *devc;
+
+	devc = sdi->priv;
+
+	if (size <= devc->pool_buffer_size && size > devc->pool_buffer_size / 2)
+		return;
+
+	kingst_laxxxx_free_transfers(sdi);
+	devc->pool_buffer_size = size;
+}
+
+static uint8_t* pool_get_buffer(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	uint8_t *buffer;
+
+	devc = sdi->priv;
+
+	if (!devc->idle_buffers)
+		return pool_alloc_buffer(sdi);
+
+	buffer = devc->idle_buffers->data;
+	devc->idle_buffers = g_slist_delete_link(devc->idle_buffers,
+			devc->idle_buffers);
+
+	return buffer;
+}
+
+static void pool_put_buffer(struct dev_context *devc, uint8_t *buffer) {
+	devc->idle_buffers = g_slist_prepend(devc->idle_buffers, buffer);
+}
+
+static struct libusb_transfer* pool_get_transfer(const struct sr_dev_inst *sdi,
+												size_t size,
+												unsigned int timeout) {
+	struct dev_context *devc;
+	struct sr_usb_dev_inst *usb;
+	struct libusb_transfer *transfer;
+	uint8_t *buf;
 
 	devc = sdi->priv;
 	usb = sdi->conn;
 
-	devc->sent_samples = 0;
-	devc->acq_aborted = FALSE;
-	devc->empty_transfer_count = 0;
+	if (devc->idle_transfers) {
+		transfer = devc->idle_transfers->data;
+		devc->idle_transfers = g_slist_delete_link(devc->idle_transfers,
+				devc->idle_transfers);
+		buf = transfer->buffer;
+	} else {
+		if (!(buf = pool_get_buffer(sdi))) {
+			sr_err("USB transfer buffer malloc failed.");
+			return NULL;
+		}
+		if (!(transfer = libusb_alloc_transfer(0))) {
+			pool_put_buffer(devc, buf);
+			return NULL;
+		}
+	}
+
+	libusb_fill_bulk_transfer(transfer, usb->devhdl,
+	USB_SAMPLING_DATA_EP, buf, size, receive_transfer, (void*) sdi,
+			timeout);
+
+	return transfer;
+}
+
+static void pool_put_transfer(struct dev_context *devc,
+								struct libusb_transfer *transfer) {
+	devc->idle_transfers = g_slist_prepend(devc->idle_transfers, transfer);
+}
+
+/* The session trigger or, when replaying, the recorded one. */
+static struct sr_trigger *get_trigger(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct sr_trigger *trigger;
+
+	devc = sdi->priv;
+
+	if (!(trigger = sr_session_trigger_get(sdi->session)))
+		trigger = devc->replay_trigger;
+
+	return trigger;
+}
+
+static int setup_soft_trigger(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct sr_trigger *trigger;
+	int pre_trigger_samples;
+
+	devc = sdi->priv;
 
-	if ((trigger = sr_session_trigger_get(sdi->session))) {
+	if ((trigger = get_trigger(sdi))) {
 		pre_trigger_samples = 0;
 		if (devc->limit_samples > 0)
 			pre_trigger_samples = (devc->capture_ratio * devc->limit_samples) / 100;
@@ -1564,6 +3931,27 @@ static int start_transfers(const struct sr_dev_inst *sdi) {
 	} else
 		devc->trigger_fired = TRUE;
 
+	return SR_OK;
+}
+
+static int start_transfers(const struct sr_dev_inst *sdi) {
+	struct dev_context *devc;
+	struct libusb_transfer *transfer;
+	unsigned int i, num_transfers;
+	int timeout, ret;
+	size_t size;
+
+	sr_dbg("start_transfers():");
+
+	devc = sdi->priv;
+
+	devc->sent_samples = 0;
+	devc->acq_aborted = FALSE;
+	devc->empty_transfer_count = 0;
+
+	if ((ret = setup_soft_trigger(sdi)) != SR_OK)
+		return ret;
+
 	sr_dbg("Samplerate: %ld", devc->cur_samplerate);
 	sr_dbg("Number of channels: %d", devc->num_channels);
 
@@ -1571,39 +3959,46 @@ static int start_transfers(const struct sr_dev_inst *sdi) {
 	sr_dbg("Number transfers was calculated: %d (0x%X)", num_transfers,
 			num_transfers);
 
-	size = get_buffer_size(devc);
+	size = kingst_laxxxx_get_buffer_size(devc);
 	sr_dbg("Buffer size for each transfer was calculated: %ld (0x%lX)", size,
 			size);
 
 	devc->submitted_transfers = 0;
+	devc->transfer_size = size;
+	pool_reserve(sdi, size);
+
+	if ((ret = pipeline_start(sdi)) != SR_OK)
+		return ret;
+
+	autotune_start(devc);
+	devc->max_transfers = num_transfers;
+	if (devc->autotune)
+		devc->max_transfers = MAX(num_transfers, AUTOTUNE_MAX_TRANSFERS);
 
-	devc->transfers = g_try_malloc0(sizeof(*devc->transfers) * num_transfers);
+	devc->transfers = g_try_malloc0(sizeof(*devc->transfers) * devc->max_transfers);
 	if (!devc->transfers) {
 		sr_err("USB transfers malloc failed.");
 		return SR_ERR_MALLOC;
 	}
 
 	timeout = get_timeout(devc);
+	devc->transfer_timeout = timeout;
 	sr_dbg("Timeout for each transfer was calculated: %d (0x%X)", timeout,
 			timeout);
 
+	/* On errors the caller cancels the transfers submitted so far. */
 	for (i = 0; i < num_transfers; i++) {
-		if (!(buf = g_try_malloc(size))) {
-			sr_err("USB transfer buffer malloc failed.");
+		if (!(transfer = pool_get_transfer(sdi, size, timeout))) {
+			devc->num_transfers = i;
 			return SR_ERR_MALLOC;
 		}
-		transfer = libusb_alloc_transfer(0);
-		libusb_fill_bulk_transfer(transfer, usb->devhdl,
-		USB_SAMPLING_DATA_EP, buf, size, receive_transfer, (void*) sdi,
-				timeout);
 
-		if ((ret = libusb_submit_transfer(transfer)) != 0) {
-			libusb_free_transfer(transfer);
-			g_free(buf);
+		if ((ret = submit_transfer(transfer)) != 0) {
+			pool_put_transfer(devc, transfer);
 			if (i == 0) {
 				sr_err("Failed to submit transfer: %s.",
 						libusb_error_name(ret));
-				kingst_laxxxx_acquisition_stop(sdi);
+				devc->num_transfers = 0;
 				return SR_ERR;
 			} else {
 				break;
@@ -1614,11 +4009,10 @@ static int start_transfers(const struct sr_dev_inst *sdi) {
 	}
 
 	devc->num_transfers = i;
+	devc->target_transfers = i;
 	sr_info("%d transfers was submited: data size 0x%lx, timeout %d",
 			devc->num_transfers, size, timeout);
 
-	std_session_send_df_header(sdi);
-
 	return SR_OK;
 }
 
@@ -1630,7 +4024,7 @@ static int control_in(libusb_device_handle *handle,
 	int actual_length = 0;
 	uint8_t empty_data[1] = { 0 };
 
-	actual_length = libusb_control_transfer(handle,
+	actual_length = kingst_laxxxx_usb_ops(handle)->control_transfer(handle,
 												LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
 												request,
 												value,
@@ -1660,7 +4054,7 @@ int control_out(libusb_device_handle *handle,
 	int actual_length = 0;
 	uint8_t empty_data[1] = { 0 };
 
-	actual_length = libusb_control_transfer(handle,
+	actual_length = kingst_laxxxx_usb_ops(handle)->control_transfer(handle,
 			LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, request, value, 0,
 			data == NULL ? empty_data : data, size,
 			USB_TIMEOUT);
@@ -1678,59 +4072,317 @@ int control_out(libusb_device_handle *handle,
 	return SR_OK;
 }
 
-int upload_bindata_sync(libusb_device_handle *handle,
-						uint8_t *bindata,
-						int size,
-						int trans_size) {
-	int data_len, err, actual_len;
+/*
+ * Spartan bitstream upload.
+ *
+ * SPARTAN_UPLOAD_TRANSFERS bulk OUT transfers of SPARTAN_UPLOAD_CHUNK_SIZE
+ * bytes are kept in flight: each completed one is resubmitted with the
+ * next chunk, and the zero length packet ending the upload is queued
+ * after the last one.
+ */
+struct bindata_upload {
+	uint8_t *data;
+	int size;
+	int chunk_size;
+	int submitted;
+	int completed;
+	int in_flight;
+	gboolean zlp_submitted;
+	int error;
+	/* Given up, the last callback frees the upload */
+	gboolean abandoned;
+	/* Transfers in flight, NULL when freed */
+	struct libusb_transfer *transfers[SPARTAN_UPLOAD_TRANSFERS];
+	/* Fake buffer of the zero length packet, NULL may not work everywhere */
+	uint8_t zlp[1];
+};
+
+static void LIBUSB_CALL
+bindata_upload_cb(struct libusb_transfer *transfer) {
+	struct bindata_upload *upload;
+	int i, ret;
+
+	upload = transfer->user_data;
+	upload->in_flight--;
+
+	if (upload->abandoned) {
+		libusb_free_transfer(transfer);
+		if (upload->in_flight == 0)
+			g_free(upload);
+		return;
+	}
+
+	ret = transfer_error(transfer);
+	if (ret == SR_OK && transfer->actual_length != transfer->length) {
+		sr_err("Failed to upload Spartan firmware: sent %d but actual sent %d.",
+				transfer->length, transfer->actual_length);
+		ret = SR_ERR_DATA;
+	}
+
+	if (ret != SR_OK) {
+		if (!upload->error)
+			upload->error = ret;
+	} else {
+		upload->completed += transfer->actual_length;
+		if (bindata_upload_next(upload, transfer->dev_handle, transfer))
+			return;
+	}
+
+	for (i = 0; i < SPARTAN_UPLOAD_TRANSFERS; i++)
+		if (upload->transfers[i] == transfer)
+			upload->transfers[i] = NULL;
+	libusb_free_transfer(transfer);
+}
+
+/*
+ * Submits the next chunk, or the zero length packet after the last one.
+ * Returns FALSE when there is nothing left to submit or on error.
+ */
+static gboolean bindata_upload_next(struct bindata_upload *upload,
+									libusb_device_handle *handle,
+									struct libusb_transfer *transfer) {
+	int length, ret;
+
+	if (upload->error)
+		return FALSE;
+
+	if (upload->submitted < upload->size) {
+		length = MIN(upload->size - upload->submitted, upload->chunk_size);
+		libusb_fill_bulk_transfer(transfer, handle, USB_UPLOAD_DATA_EP,
+				upload->data + upload->submitted, length, bindata_upload_cb,
+				upload, USB_TIMEOUT);
+	} else if (!upload->zlp_submitted) {
+		length = 0;
+		libusb_fill_bulk_transfer(transfer, handle, USB_UPLOAD_DATA_EP,
+				upload->zlp, 0, bindata_upload_cb, upload, USB_TIMEOUT);
+		upload->zlp_submitted = TRUE;
+	} else {
+		return FALSE;
+	}
+
+	if ((ret = submit_transfer(transfer)) < 0) {
+		upload->error = ret;
+		return FALSE;
+	}
+
+	upload->submitted += length;
+	upload->in_flight++;
+
+	return TRUE;
+}
+
+int upload_bindata(libusb_context *ctx,
+					libusb_device_handle *handle,
+					uint8_t *bindata,
+					int size,
+					int packet_size) {
+	struct bindata_upload *upload;
+	struct libusb_transfer *transfer;
+	struct timeval tv;
+	int64_t start, elapsed, now, deadline;
+	gboolean cancelled;
+	int i, ret, completed;
+
+	/* The callbacks may outlive this call if the transfers hang. */
+	if (!(upload = g_try_new0(struct bindata_upload, 1)))
+		return LIBUSB_ERROR_NO_MEM;
+	upload->data = bindata;
+	upload->size = size;
+	/* Whole packets, the last one may be short. */
+	upload->chunk_size = MAX(SPARTAN_UPLOAD_CHUNK_SIZE / packet_size, 1)
+			* packet_size;
+
+	start = g_get_monotonic_time();
 
-	while (size > 0) {
-		data_len = size;
-		if (data_len > trans_size) {
-			data_len = trans_size;
+	for (i = 0; i < SPARTAN_UPLOAD_TRANSFERS; i++) {
+		if (!(transfer = libusb_alloc_transfer(0))) {
+			upload->error = LIBUSB_ERROR_NO_MEM;
+			break;
 		}
-		err = libusb_bulk_transfer(handle,
-									USB_UPLOAD_DATA_EP,
-									bindata,
-									data_len,
-									&actual_len,
-									100);
-		if (err) {
-			sr_err("Failed to upload Spartan firmware: %s.",
-						libusb_error_name(err));
-			return err;
-		} else if (actual_len != data_len) {
-			sr_err(
-					"Failed to upload Spartan firmware: sent %d but actual sent %d.",
-					data_len, actual_len);
-			return SR_ERR_DATA;
+		if (!bindata_upload_next(upload, handle, transfer)) {
+			libusb_free_transfer(transfer);
+			break;
 		}
-		size -= actual_len;
-		bindata += actual_len;
+		upload->transfers[i] = transfer;
 	}
-	err = libusb_bulk_transfer(handle,
-								USB_UPLOAD_DATA_EP,
-								(unsigned char*) &data_len, // fake buffer for 0-sized transfer (passing NULL may be not working in some systems)
-								0,
-								&actual_len,
-								100);
-	if (err) {
+
+	/*
+	 * After an error the transfers still in flight are cancelled. Each
+	 * chunk has USB_TIMEOUT to complete: the upload times out when there
+	 * is no progress for twice that, and the cancelled transfers are
+	 * waited for only until the deadline.
+	 */
+	cancelled = FALSE;
+	completed = 0;
+	deadline = start + 2 * USB_TIMEOUT * 1000;
+	while (upload->in_flight > 0) {
+		now = g_get_monotonic_time();
+		if (!cancelled && upload->completed != completed) {
+			completed = upload->completed;
+			deadline = now + 2 * USB_TIMEOUT * 1000;
+		}
+		if (now >= deadline) {
+			if (cancelled) {
+				sr_err("%d Spartan firmware transfers didn't finish, "
+						"abandoning them.", upload->in_flight);
+				upload->abandoned = TRUE;
+				return LIBUSB_ERROR_TIMEOUT;
+			}
+			if (!upload->error)
+				upload->error = LIBUSB_ERROR_TIMEOUT;
+		} else {
+			tv.tv_sec = 0;
+			tv.tv_usec = USB_TIMEOUT * 100;
+			ret = kingst_laxxxx_usb_ops(handle)->handle_events(ctx, &tv, NULL);
+			if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+				if (!upload->error)
+					upload->error = ret;
+				/* Don't spin on an event loop failing at once. */
+				g_usleep(1000);
+			}
+		}
+		if (upload->error && !cancelled) {
+			for (i = 0; i < SPARTAN_UPLOAD_TRANSFERS; i++)
+				if (upload->transfers[i])
+					cancel_transfer(upload->transfers[i]);
+			cancelled = TRUE;
+			deadline = g_get_monotonic_time() + USB_TIMEOUT * 1000;
+		}
+	}
+
+	ret = upload->error;
+	g_free(upload);
+
+	if (ret) {
 		sr_err("Failed to upload Spartan firmware: %s.",
-					libusb_error_name(err));
+				libusb_error_name(ret));
+		return ret;
+	}
+
+	elapsed = MAX(g_get_monotonic_time() - start, 1);
+	sr_info("Uploaded %d bytes of Spartan firmware in %" PRId64 " us: "
+			"%.1f MB/s, %.0f%% of the USB 2.0 bulk limit.", size, elapsed,
+			(double) size / elapsed,
+			100.0 * size * 1000000 / elapsed / USB2_BULK_MAX_BYTES_PER_SEC);
+
+	return SR_OK;
+}
+
+static int device_get_config(libusb_device_handle *handle,
+								int *num_interfaces,
+								int *num_endpoints) {
+	struct libusb_config_descriptor *config;
+	int err;
+
+	err = libusb_get_active_config_descriptor(libusb_get_device(handle),
+			&config);
+	if (err)
 		return err;
+	*num_interfaces = config->bNumInterfaces;
+	*num_endpoints = config->interface->altsetting->bNumEndpoints;
+	libusb_free_config_descriptor(config);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int device_get_max_packet_size(libusb_device_handle *handle,
+										unsigned char endpoint) {
+	struct libusb_device *usbdev;
+
+	if (!(usbdev = libusb_get_device(handle)))
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	return libusb_get_max_packet_size(usbdev, endpoint);
+}
+
+static const struct kingst_laxxxx_usb_ops device_usb_ops = {
+	.poll_ms = 0,
+	.get_config = device_get_config,
+	.get_max_packet_size = device_get_max_packet_size,
+	.claim_interface = libusb_claim_interface,
+	.release_interface = libusb_release_interface,
+	.close = libusb_close,
+	.control_transfer = libusb_control_transfer,
+	.submit_transfer = libusb_submit_transfer,
+	.cancel_transfer = libusb_cancel_transfer,
+	.handle_events = libusb_handle_events_timeout_completed,
+};
+
+/*
+ * USB calls of the handle, the emulator serves its own handle.
+ */
+const struct kingst_laxxxx_usb_ops* kingst_laxxxx_usb_ops(libusb_device_handle *hdl) {
+#ifdef KINGST_LAXXXX_EMULATOR
+	if (kingst_laxxxx_is_emulated(hdl))
+		return &kingst_laxxxx_emulator_ops;
+#else
+	(void) hdl;
+#endif
+
+	return &device_usb_ops;
+}
+
+static int get_max_packet_size(libusb_device_handle *handle,
+								unsigned char endpoint) {
+	return kingst_laxxxx_usb_ops(handle)->get_max_packet_size(handle, endpoint);
+}
+
+static int submit_transfer(struct libusb_transfer *transfer) {
+	return kingst_laxxxx_usb_ops(transfer->dev_handle)->submit_transfer(transfer);
+}
+
+static int cancel_transfer(struct libusb_transfer *transfer) {
+	return kingst_laxxxx_usb_ops(transfer->dev_handle)->cancel_transfer(transfer);
+}
+
+/* Names of the overload policies, indexed by enum kingst_laxxxx_overload */
+const char *kingst_laxxxx_overload_names[3] = {
+	"abort",
+	"drop-oldest",
+	"drop-newest",
+};
+
+/*
+ * Defaults of the tunables from the environment variables.
+ */
+static void tunables_init(struct kingst_laxxxx_tunables *tunables) {
+	const char *overload;
+	unsigned int i;
+
+	tunables->transfer_size = get_env_uint(TRANSFER_SIZE_ENV, 0);
+	tunables->num_transfers = get_env_uint(NUM_TRANSFERS_ENV, 0);
+	tunables->autotune = get_env_uint(AUTOTUNE_ENV, 0) != 0;
+	tunables->pipeline_depth = get_env_uint(PIPELINE_DEPTH_ENV, 0);
+	tunables->max_latency = get_env_uint(MAX_LATENCY_ENV, 0);
+	tunables->packet_size = get_env_uint(PACKET_SIZE_ENV, 0);
+	tunables->packet_age = get_env_uint(PACKET_AGE_ENV, PACKET_AGE_DEFAULT_MS);
+	tunables->usb_thread = get_env_uint(USB_THREAD_ENV, 0) != 0;
+
+	tunables->overload = OVERLOAD_ABORT;
+	overload = g_getenv(OVERLOAD_ENV);
+	if (!overload)
+		return;
+	for (i = 0; i < G_N_ELEMENTS(kingst_laxxxx_overload_names); i++) {
+		if (!strcmp(overload, kingst_laxxxx_overload_names[i])) {
+			tunables->overload = i;
+			return;
+		}
 	}
-	return size;
+	sr_warn("Unknown overload policy '%s', aborting on overload.", overload);
 }
 
 struct dev_context* kingst_laxxxx_dev_new(const uint16_t vendor_id, const char * vendor_name) {
 	struct dev_context *devc;
 
 	devc = g_malloc0(sizeof(struct dev_context));
+	tunables_init(&devc->tunables);
+	g_mutex_init(&devc->send_mutex);
 	devc->profile.vid = vendor_id;
 	devc->profile.vendor = vendor_name;
 	devc->fw_updated = 0;
 	devc->cur_samplerate = 0;
 	devc->limit_samples = 0;
+	devc->limit_frames = 0;
 	devc->capture_ratio = 0;
 	devc->num_channels = 0;
 	devc->convbuffer = NULL;
@@ -21,6 +21,7 @@
 #define LIBSIGROK_HARDWARE_KINGST_LA1010_PROTOCOL_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include <glib.h>
 #include <string.h>
 #include <libusb.h>
@@ -74,6 +75,67 @@
 #define CMD_SMPL_STATUS_2                0x02
 #define CMD_SMPL_STATUS_RUN              0x03
 
+/* Size of the device ID read from the running Spartan */
+#define SPARTAN_ID_SIZE                  12
+
+/* Name of environment variable to force the sample conversion engine */
+#define CONVERT_ENGINE_ENV              "KINGST_LAXXXX_CONVERT_ENGINE"
+/* Number of spare buffers of conversion pipeline, 0 -- convert in libusb callback */
+#define PIPELINE_DEPTH_ENV              "KINGST_LAXXXX_PIPELINE_DEPTH"
+/* Number of threads converting one transfer, 0 -- number of CPUs */
+#define CONVERT_THREADS_ENV             "KINGST_LAXXXX_CONVERT_THREADS"
+#define MAX_CONVERT_THREADS             64
+/* Size of each bulk transfer in bytes, overrides the computed one */
+#define TRANSFER_SIZE_ENV               "KINGST_LAXXXX_TRANSFER_SIZE"
+/* Number of bulk transfers, overrides the computed one */
+#define NUM_TRANSFERS_ENV               "KINGST_LAXXXX_NUM_TRANSFERS"
+/* Set to 1 to tune the transfers from the first completions of a capture */
+#define AUTOTUNE_ENV                    "KINGST_LAXXXX_AUTOTUNE"
+/* Bound of the sample age in ms: sizes the transfers for live view */
+#define MAX_LATENCY_ENV                 "KINGST_LAXXXX_MAX_LATENCY_MS"
+/* Size in bytes of the SR_DF_LOGIC packets to merge the samples into */
+#define PACKET_SIZE_ENV                 "KINGST_LAXXXX_PACKET_SIZE"
+/* Longest time in ms the samples wait for a merged packet to fill */
+#define PACKET_AGE_ENV                  "KINGST_LAXXXX_PACKET_AGE_MS"
+/* Full sample ring policy: "abort" (default), "drop-oldest" or "drop-newest" */
+#define OVERLOAD_ENV                    "KINGST_LAXXXX_OVERLOAD"
+/* Set to 1 to handle the USB events on a dedicated thread */
+#define USB_THREAD_ENV                  "KINGST_LAXXXX_USB_THREAD"
+/* CPU to run the USB thread on */
+#define USB_THREAD_CPU_ENV              "KINGST_LAXXXX_USB_THREAD_CPU"
+/* SCHED_FIFO priority of the USB thread, 0 -- normal scheduling */
+#define USB_THREAD_PRIORITY_ENV         "KINGST_LAXXXX_USB_THREAD_PRIORITY"
+/* Set to 1 to lock the transfer buffers in RAM when not allocated by usbfs */
+#define MLOCK_ENV                       "KINGST_LAXXXX_MLOCK"
+/* Set to 1 to send the samples as bitplanes instead of SR_DF_LOGIC */
+#define BITPLANES_ENV                   "KINGST_LAXXXX_BITPLANES"
+
+/* File to record the received bulk transfers to */
+#define RECORD_FILE_ENV                 "KINGST_LAXXXX_RECORD"
+/* Recorded file to replay by a virtual device instead of the hardware */
+#define REPLAY_FILE_ENV                 "KINGST_LAXXXX_REPLAY"
+/* Set to 1 to replay at the recorded pace instead of full speed */
+#define REPLAY_REALTIME_ENV             "KINGST_LAXXXX_REPLAY_REALTIME"
+/* Options of the software device emulator added by scan(), see emulator.c */
+#define EMULATOR_ENV                    "KINGST_LAXXXX_EMULATOR"
+
+/*
+ * Raw bulk stream file, all values are little-endian:
+ *   header:  magic[8], channels mask (2), number of trigger matches (2),
+ *            reserved (4), samplerate (8), limit samples (8),
+ *            capture ratio (8)
+ *   matches: stage (1), channel index (1), match type (1), reserved (1)
+ *   records: length (4), libusb transfer status (4), time since the start
+ *            in microseconds (8), data['length']
+ */
+#define RAW_FILE_MAGIC                  "KLARAW01"
+#define RAW_FILE_HEADER_SIZE            40
+#define RAW_FILE_MATCH_SIZE             4
+#define RAW_FILE_RECORD_SIZE            16
+
+/* Size of converted samples block, it should fit into L2 cache */
+#define CONVERT_BLOCK_SIZE              (256 * 1024)
+
 #define SAMPLING_BASE_FREQUENCY         800000000
 #define PWM_BASE_FREQUENCY              200000000
 
@@ -108,6 +170,101 @@ struct samples_config {
 	uint32_t samples_rate;
 };
 
+/*
+ * Driver specific datafeed packet type sent in bitplane mode instead of
+ * SR_DF_LOGIC, the payload is struct kingst_laxxxx_bitplanes.
+ */
+#define KINGST_LAXXXX_DF_BITPLANES      0x4B42
+
+/*
+ * Samples of one channel as sent by the device: every little-endian
+ * 16-bit word holds 16 consecutive samples, the first one in bit 0.
+ * Successive words of the channel are 'stride' bytes apart. 'data'
+ * points into the USB buffer and is valid during the packet callback only.
+ */
+struct kingst_laxxxx_bitplane {
+	int channel;
+	uint64_t sample_offset;
+	uint64_t num_samples;
+	size_t stride;
+	const uint8_t *data;
+};
+
+struct kingst_laxxxx_bitplanes {
+	int num_planes;
+	struct kingst_laxxxx_bitplane planes[16];
+};
+
+/*
+ * Driver specific datafeed packet sent when sample data was lost: the
+ * samples following it were captured 'lost_samples' samples after the
+ * ones sent before it. The payload is struct kingst_laxxxx_gap. It comes
+ * between SR_DF_FRAME_END and SR_DF_FRAME_BEGIN, so clients that don't
+ * know it still see the discontinuity.
+ */
+#define KINGST_LAXXXX_DF_GAP            0x4B43
+
+struct kingst_laxxxx_gap {
+	uint64_t sample_offset;
+	uint64_t lost_samples;
+};
+
+/*
+ * Driver specific datafeed packet sent every second with a latency bound:
+ * the age of the oldest sample of the transfers when they were sent, in
+ * microseconds. The payload is struct kingst_laxxxx_latency.
+ */
+#define KINGST_LAXXXX_DF_LATENCY        0x4B44
+
+struct kingst_laxxxx_latency {
+	uint64_t bound;
+	uint64_t max;
+	uint64_t average;
+};
+
+/*
+ * Driver specific datafeed packet sent after the SR_DF_FRAME_END of every
+ * segment of a segmented capture. The payload is struct
+ * kingst_laxxxx_segment: the samples lost in the segment and the dead
+ * time before the next one in microseconds, 0 after the last segment.
+ */
+#define KINGST_LAXXXX_DF_SEGMENT        0x4B45
+
+struct kingst_laxxxx_segment {
+	uint64_t segment;
+	uint64_t lost_samples;
+	uint64_t dead_time;
+};
+
+enum kingst_laxxxx_overload {
+	OVERLOAD_ABORT,
+	OVERLOAD_DROP_OLDEST,
+	OVERLOAD_DROP_NEWEST,
+};
+
+/*
+ * Per-device tunables read at the acquisition start. They are set with
+ * config_set(), the defaults are taken from the environment variables
+ * above when the device is created.
+ */
+struct kingst_laxxxx_tunables {
+	/* Bulk transfer size in bytes, 0 -- computed */
+	uint64_t transfer_size;
+	/* Number of bulk transfers, 0 -- computed */
+	uint64_t num_transfers;
+	gboolean autotune;
+	/* Spare buffers of the conversion pipeline, 0 -- convert in the callback */
+	uint64_t pipeline_depth;
+	enum kingst_laxxxx_overload overload;
+	/* Bound of the sample age in ms, 0 -- no bound */
+	uint64_t max_latency;
+	/* Merged SR_DF_LOGIC packet size in bytes, 0 -- no merging */
+	uint64_t packet_size;
+	/* Longest wait of the samples for a merged packet in ms */
+	uint64_t packet_age;
+	gboolean usb_thread;
+};
+
 struct kingst_laxxxx_desc {
 	char *model;
 
@@ -128,8 +285,32 @@ struct kingst_laxxxx_profile {
 	struct kingst_laxxxx_desc * description;
 };
 
+/*
+ * Transposes full groups of 'num_channels' words (16 samples each)
+ * to 16-bit samples.
+ */
+typedef void (*transpose_groups_fn)(const uint16_t *channel_masks,
+									int num_channels,
+									uint8_t *dest,
+									const uint8_t *src,
+									size_t num_groups);
+
+struct convert_engine {
+	const char *name;
+	gboolean (*is_supported)(void);
+	transpose_groups_fn transpose;
+	/* Variants for the given number of enabled channels, may be NULL */
+	transpose_groups_fn specialized[17];
+};
+
+/* Consumer of sample data, returns FALSE to stop the acquisition. */
+typedef gboolean (*kingst_laxxxx_sample_fn)(const struct sr_dev_inst *sdi,
+											const uint8_t *buffer,
+											size_t length);
+
 struct dev_context {
 	struct kingst_laxxxx_profile profile;
+	struct kingst_laxxxx_tunables tunables;
 	/*
 	 * Since we can't keep track of an fx2lafw device after upgrading
 	 * the firmware (it renumerates into a different device address
@@ -143,6 +324,8 @@ struct dev_context {
 
 	uint64_t cur_samplerate;
 	uint64_t limit_samples;
+	/* Segmented capture: number of 'limit_samples' frames, 0 -- off */
+	uint64_t limit_frames;
 
 	uint64_t capture_ratio;
 
@@ -159,8 +342,29 @@ struct dev_context {
 	int submitted_transfers;
 	int empty_transfer_count;
 
+	/* Limit of the transfer buffers in bytes, 0 -- none */
+	uint64_t buffer_size;
 	unsigned int num_transfers;
+	unsigned int max_transfers;
 	struct libusb_transfer **transfers;
+	size_t transfer_size;
+	unsigned int transfer_timeout;
+
+	/* Idle transfers, with buffers, and spare buffers kept across acquisitions */
+	GSList *idle_transfers;
+	GSList *idle_buffers;
+	size_t pool_buffer_size;
+	GHashTable *dev_mem_buffers;
+	gboolean dev_mem_failed;
+
+	gboolean autotune;
+	unsigned int autotune_window;
+	unsigned int autotune_completions;
+	unsigned int autotune_skip;
+	unsigned int target_transfers;
+	int64_t autotune_last;
+	int64_t autotune_max_gap;
+	int64_t autotune_max_busy;
 	struct sr_context *ctx;
 
 	uint16_t cur_channels;
@@ -168,9 +372,136 @@ struct dev_context {
 	int cur_channel;
 	uint16_t channel_masks[16];
 	uint16_t channel_data[16];
+	/* Words up to the next channel group after lost data */
+	unsigned int skip_words;
+	unsigned int failed_transfers;
+	uint64_t failed_bytes;
+	unsigned int short_transfers;
+	transpose_groups_fn transpose_groups;
+	int unitsize;
 	uint64_t sent_samples;
+	gboolean bitplanes;
+	uint64_t received_words;
 	uint8_t *convbuffer;
 	size_t convbuffer_size;
+
+	uint64_t num_frames;
+	gboolean frame_open;
+	uint64_t frame_lost;
+	int64_t rearm_max;
+
+	/* Merged SR_DF_LOGIC packet, NULL -- one packet per block */
+	uint8_t *packet_buffer;
+	size_t packet_size;
+	size_t packet_length;
+	int64_t packet_age;
+	int64_t packet_time;
+	/* Completion of the transfer with the oldest samples of the packet */
+	int64_t packet_completed;
+	size_t packet_completed_length;
+	uint64_t packets_sent;
+	uint64_t packet_bytes;
+	/* Completion time and length of the transfer being processed */
+	int64_t data_completed;
+	size_t data_length;
+
+	unsigned int convert_threads;
+	GThreadPool *convert_pool;
+	struct convert_slice *convert_slices;
+	GMutex convert_mutex;
+	GCond convert_cond;
+	int convert_pending;
+
+	FILE *record_file;
+	int64_t record_start;
+
+	char *replay_path;
+	FILE *replay_file;
+	struct sr_trigger *replay_trigger;
+	gboolean replay_realtime;
+	int64_t replay_start;
+	gboolean replay_pending;
+	uint32_t replay_length;
+	int32_t replay_status;
+	uint64_t replay_time;
+	uint8_t *replay_buffer;
+	size_t replay_buffer_size;
+
+	/* Start of the acquisition, of the sampling and first samples, in us */
+	int64_t start_time;
+	int64_t sampling_start;
+	int64_t first_samples;
+
+#ifdef KINGST_LAXXXX_EMULATOR
+	/* Handle of the software emulator, NULL for the real device */
+	struct libusb_device_handle *emulator;
+#endif
+
+	/* SHA-256 of the bitstream uploaded to the Spartan, NULL -- none */
+	gchar *spartan_hash;
+	/* Device ID the Spartan reported after that upload */
+	uint8_t spartan_id[SPARTAN_ID_SIZE];
+
+	/* Bound of the sample age in us, 0 -- no bound */
+	uint64_t max_latency;
+	int64_t latency_report;
+	uint64_t latency_max;
+	uint64_t latency_sum;
+	uint64_t latency_count;
+	uint64_t latency_peak;
+
+	gboolean use_usb_thread;
+	GThread *usb_thread;
+	int usb_thread_done;
+
+	unsigned int pipeline_depth;
+	GThread *pipeline_thread;
+	GAsyncQueue *pipeline_free;
+	GAsyncQueue *pipeline_full;
+	gint stop_requested;
+	/* Serializes the packets of the conversion and the session threads */
+	GMutex send_mutex;
+	enum kingst_laxxxx_overload overload;
+	/* Stream offsets of the queued and of the processed data */
+	uint64_t pipeline_offset;
+	uint64_t pipeline_consumed;
+	unsigned int pipeline_max_queued;
+	/* Buffers queued to the consumer, read by config_get() */
+	gint pipeline_queued;
+	unsigned int pipeline_overflows;
+	uint64_t pipeline_dropped_bytes;
+};
+
+/*
+ * USB calls of a device handle: libusb for the hardware, the software
+ * emulator for its handle.
+ */
+struct kingst_laxxxx_usb_ops {
+	/* Period of the session source handling the transfers, 0 -- libusb pollfds */
+	int poll_ms;
+	int (*get_config)(struct libusb_device_handle *hdl,
+						int *num_interfaces,
+						int *num_endpoints);
+	int (*get_max_packet_size)(struct libusb_device_handle *hdl,
+								unsigned char endpoint);
+	int (LIBUSB_CALL *claim_interface)(struct libusb_device_handle *hdl,
+										int interface_number);
+	int (LIBUSB_CALL *release_interface)(struct libusb_device_handle *hdl,
+										int interface_number);
+	void (LIBUSB_CALL *close)(struct libusb_device_handle *hdl);
+	int (LIBUSB_CALL *control_transfer)(struct libusb_device_handle *hdl,
+										uint8_t request_type,
+										uint8_t request,
+										uint16_t value,
+										uint16_t index,
+										unsigned char *data,
+										uint16_t length,
+										unsigned int timeout);
+	int (LIBUSB_CALL *submit_transfer)(struct libusb_transfer *transfer);
+	int (LIBUSB_CALL *cancel_transfer)(struct libusb_transfer *transfer);
+	int (LIBUSB_CALL *handle_events)(libusb_context *ctx,
+									struct timeval *tv,
+									int *completed);
 };
 
 union fx_status {
@@ -184,24 +515,61 @@ union spartan_status {
 	uint32_t code;
 };
 
+SR_PRIV extern const char *kingst_laxxxx_overload_names[3];
+
 SR_PRIV struct dev_context* kingst_laxxxx_dev_new(const uint16_t vendor_id, const char * vendor_name);
 SR_PRIV int kingst_laxxxx_has_fx_firmware(struct libusb_device_handle *hdl, struct kingst_laxxxx_desc ** device_desc);
 int kingst_laxxxx_upload_cypress_firmware(struct sr_context *ctx,
 											struct libusb_device_handle *hdl,
 											const struct kingst_laxxxx_profile *prof);
 SR_PRIV int kingst_laxxxx_upload_spartan_firmware(const struct sr_dev_inst *sdi);
+SR_PRIV void kingst_laxxxx_firmware_cache_free(void);
 SR_PRIV int kingst_laxxxx_init_spartan(struct libusb_device_handle *handle);
 SR_PRIV int kingst_laxxxx_dev_open(const struct sr_dev_inst *sdi);
 SR_PRIV int kingst_laxxxx_abort_acquisition_request(libusb_device_handle *handle);
+SR_PRIV void kingst_laxxxx_free_transfers(const struct sr_dev_inst *sdi);
 SR_PRIV int kingst_laxxxx_acquisition_start(const struct sr_dev_inst *sdi);
 SR_PRIV int kingst_laxxxx_acquisition_stop(const struct sr_dev_inst *sdi);
 SR_PRIV int kingst_laxxxx_set_logic_level(struct libusb_device_handle *hdl, double level);
 SR_PRIV int kingst_laxxxx_receive_data(int fd, int revents, void *cb_data);
 SR_PRIV int kingst_laxxxx_configure_channels(const struct sr_dev_inst *sdi);
+SR_PRIV unsigned int kingst_laxxxx_pipeline_occupancy(const struct sr_dev_inst *sdi);
+SR_PRIV size_t kingst_laxxxx_get_buffer_size(struct dev_context *devc);
+SR_PRIV int kingst_laxxxx_read_hex_line(unsigned char *firmware,
+										size_t fw_size,
+										size_t *offset,
+										uint16_t *addr,
+										unsigned char *buffer);
+SR_PRIV const struct kingst_laxxxx_usb_ops* kingst_laxxxx_usb_ops(struct libusb_device_handle *hdl);
 SR_PRIV int kingst_laxxxx_configure_pwm(struct libusb_device_handle *hdl,
 										uint64_t pwm1_freq,
 										uint64_t pwm1_duty,
 										uint64_t pwm2_freq,
 										uint64_t pwm2_duty);
 
+/* convert.c */
+SR_PRIV const struct convert_engine* kingst_laxxxx_get_convert_engine(void);
+SR_PRIV const struct convert_engine* kingst_laxxxx_convert_engines(unsigned int *count);
+SR_PRIV int kingst_laxxxx_convert_pool_start(struct dev_context *devc);
+SR_PRIV void kingst_laxxxx_convert_pool_stop(struct dev_context *devc);
+SR_PRIV size_t kingst_laxxxx_convert_sample_data(struct dev_context *devc,
+												uint8_t *dest,
+												size_t destcnt,
+												const uint8_t *src,
+												size_t srccnt);
+SR_PRIV gboolean kingst_laxxxx_walk_sample_data(const struct sr_dev_inst *sdi,
+												const uint8_t *buffer,
+												size_t length,
+												kingst_laxxxx_sample_fn block,
+												kingst_laxxxx_sample_fn bitplanes);
+
+#ifdef KINGST_LAXXXX_EMULATOR
+/* Size of the blank Spartan bitstream uploaded to the emulator */
+#define EMULATOR_BITSTREAM_SIZE (340 * 1024)
+
+SR_PRIV extern const struct kingst_laxxxx_usb_ops kingst_laxxxx_emulator_ops;
+SR_PRIV struct libusb_device_handle* kingst_laxxxx_emulator_open(const char *options);
+SR_PRIV gboolean kingst_laxxxx_is_emulated(struct libusb_device_handle *hdl);
+#endif
+
 #endif